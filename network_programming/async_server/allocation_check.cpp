@@ -0,0 +1,118 @@
+// Allocation check for async_server's echo path: runs MyServer in this
+// process with the line protocol, replaces the global operator new with one
+// that counts, and fails if a warmed-up echo loop allocates at all.
+//
+// usage: allocation_check [round trips]                        (20000)
+//
+// Round trips send one line and read its echo, cycling through REPLY_SIZES;
+// most of them are longer than std::string's small buffer, so a copy through
+// a string anywhere on the path shows up. The first WARMUP_ROUNDS fill the
+// shard's chunk pool, the handler memory and the connection's queues; after
+// that, the server and this client together must not allocate. Prints the
+// count and the sizes of the first allocations seen, exits 1 if there were
+// any. Replies stay within CHUNK_SIZE: a larger one is expected to allocate.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	std::atomic<unsigned long>	allocations(0);
+
+	// the first allocations while counting, for the report
+	const std::size_t							RECORDED = 16;
+	std::size_t										recordedSizes[RECORDED];
+	std::atomic<bool>							counting(false);
+}
+
+void* operator new(std::size_t size)
+{
+	if (counting.load(std::memory_order_relaxed))
+	{
+		unsigned long n = allocations.fetch_add(1, std::memory_order_relaxed);
+		if (n < RECORDED)
+			recordedSizes[n] = size;
+	}
+
+	void* p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+#define ASYNC_SERVER_NO_MAIN
+#include "async_server.cpp"
+
+// a port of its own, so the check runs next to a server on PORT
+const unsigned short CHECK_PORT = 11237;
+
+const std::size_t REPLY_SIZES[] = { 8, 100, 1000, 4000, 8000 };
+const unsigned long WARMUP_ROUNDS = 1000;
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		unsigned long rounds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+
+		MyServer server(1, CHECK_PORT, LineFraming);
+		server.start();
+
+		// built up front: the client must not allocate while counting either
+		const std::size_t sizes = sizeof(REPLY_SIZES) / sizeof(REPLY_SIZES[0]);
+		std::vector<std::string> requests;
+		for (std::size_t size: REPLY_SIZES)
+			requests.push_back(std::string(size, 'x') + '\n');
+		std::vector<char> reply(REPLY_SIZES[sizes - 1]);
+
+		boost::asio::io_service service;
+		tcp::socket socket(service);
+		socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), CHECK_PORT));
+		socket.set_option(tcp::no_delay(true));
+
+		for (unsigned long i = 0; i < WARMUP_ROUNDS + rounds; ++i)
+		{
+			if (i == WARMUP_ROUNDS)
+				counting = true;
+
+			std::size_t size = REPLY_SIZES[i % sizes];
+			boost::asio::write(socket, boost::asio::buffer(requests[i % sizes]));
+			boost::asio::read(socket, boost::asio::buffer(reply.data(), size));
+
+			if (std::count(reply.begin(), reply.begin() + size, 'x') != static_cast<std::ptrdiff_t>(size))
+			{
+				counting = false;
+				std::cerr << "allocation_check: wrong echo of " << size << " bytes" << std::endl;
+				return 1;
+			}
+		}
+		counting = false;
+
+		unsigned long seen = allocations;
+		std::cout << "allocation_check: " << rounds << " echoes of " << REPLY_SIZES[0] << " to "
+							<< REPLY_SIZES[sizes - 1] << " bytes, " << seen << " allocations" << std::endl;
+		for (unsigned long i = 0; i < seen && i < RECORDED; ++i)
+			std::cout << "  allocation of " << recordedSizes[i] << " bytes" << std::endl;
+
+		socket.close();
+		server.stopAllConnections();
+
+		return seen ? 1 : 0;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return 1;
+	}
+}
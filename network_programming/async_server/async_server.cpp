@@ -1,13 +1,31 @@
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <istream>
-#include <list>
+#include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
+#include "../common/admission_control.hpp"
+#include "../common/latency_recorder.hpp"
+#include "../common/listener_handoff.hpp"
+#include "chunk_pool.hpp"
+#include "flat_buffer.hpp"
+#include "framing.hpp"
+#include "handler_allocator.hpp"
+#include "slab_registry.hpp"
+#include "topic_registry.hpp"
 
 using boost::asio::ip::tcp;
 
@@ -15,13 +33,87 @@ using boost::asio::ip::tcp;
 typedef boost::asio::ip::tcp::acceptor	acceptor_type;
 typedef boost::asio::ip::tcp::socket	socket_type;
 
+#ifdef SO_REUSEPORT
+// lets several acceptors bind the same port, asio has no portable option for it
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
 // port no. to bind the server to.
 const short PORT = 11235;
 
+// port of the listener that frames messages with a varint length prefix
+const short FRAMED_PORT = 11236;
+
+// largest payload a frame may have by default; a connection receiving a
+// longer one is closed
+const std::size_t MAX_FRAME_PAYLOAD = 16 * 1024 * 1024;
+
+// free space requested from the receive buffer for every read
+const std::size_t READ_SIZE = 4096;
+
+// receive chunks lent to reading connections: a partial message of less than
+// READ_SIZE bytes and the next read always fit
+const std::size_t CHUNK_SIZE = 2 * READ_SIZE;
+
+// chunks a shard keeps for reuse once they are given back
+const std::size_t MAX_IDLE_CHUNKS = 1024;
+
+// unsent bytes per connection above which asyncWrite() reports backpressure
+const std::size_t WRITE_HIGH_WATERMARK = 1024 * 1024;
+
+// after a hot restart, how long the old process waits for its connections to end
+const int DRAIN_SECONDS = 30;
+
+// admission control of main()'s servers, see admission_control.hpp. No cap
+// per source address: the benchmarks open thousands of connections from
+// 127.0.0.1.
+const std::size_t MAX_CONNECTIONS = 16384;
+const double ACCEPT_RATE = 10000;		// connections per second
+const double ACCEPT_BURST = 1000;
+
+class MyConnection;
+
+// live connections of one shard, only touched from that shard's thread
+typedef SlabRegistry<boost::weak_ptr<MyConnection> > ConnectionRegistry;
+
+// names a connection from any thread: the shard that owns it and its registry slot
+struct ConnectionHandle
+{
+	std::size_t									shard;
+	ConnectionRegistry::Handle	slot;
+};
+
+// An encoded message, immutable once queued: a publication is encoded once and
+// queued by reference on every subscriber, the last write to finish frees it.
+typedef boost::shared_ptr<const std::string> SharedPayload;
+
+// subscribers of one shard by topic, only touched from that shard's thread
+typedef TopicRegistry<boost::weak_ptr<MyConnection> > SubscriberRegistry;
+
+// hands a publication to every shard of the server, from any shard thread
+typedef boost::function<void (const std::string& topic, SharedPayload payload)> Publisher;
+
 class MyConnection : public boost::enable_shared_from_this<MyConnection>
 {
 	public:
-		MyConnection(boost::asio::io_service& ioservice) : socket(ioservice) 
+		// receive memory is borrowed from "chunks" while a read is under way;
+		// a frame longer than maxFrame closes the connection
+		MyConnection(boost::asio::io_service& ioservice, ChunkPool& chunks,
+								 Framing framing = DelimitedFraming, std::size_t maxFrame = MAX_FRAME_PAYLOAD) : 
+			socket(ioservice),
+			m_chunks(chunks),
+			m_borrowing(false),
+			m_buffer(0),
+			m_codec(makeFrameCodec(framing, maxFrame)),
+			m_needed(0),
+			m_queuedBytes(0),
+			m_writing(false),
+			m_registry(nullptr),
+			m_subscribers(nullptr),
+			m_publish(nullptr),
+			m_admission(nullptr),
+			m_firstByteSeen(false),
+			m_echo(framing == LineFraming)
 		{}
 		
 		~MyConnection() {}
@@ -33,6 +125,9 @@ class MyConnection : public boost::enable_shared_from_this<MyConnection>
 		
 		void Session()
 		{
+			// readableHandler() reads without blocking
+			boost::system::error_code ignored;
+			socket.non_blocking(true, ignored);
 			asyncRead();
 		}
 		
@@ -41,85 +136,518 @@ class MyConnection : public boost::enable_shared_from_this<MyConnection>
 			socket.cancel();
 		}
 		
+		// called by the shard once the connection is in its registry
+		void Register(ConnectionRegistry& registry, SubscriberRegistry& subscribers,
+									const Publisher& publish, ConnectionHandle handle)
+		{
+			m_registry = &registry;
+			m_subscribers = &subscribers;
+			m_publish = &publish;
+			m_handle = handle;
+			m_acceptedAt = clock_type::now();
+		}
+		
+		// called by the shard once "admission" admitted the connection from
+		// "peer", to release it when the connection ends
+		void Admitted(admission_control& admission, const admission_control::address_type& peer)
+		{
+			m_admission = &admission;
+			m_peer = peer;
+		}
+		
+		ConnectionHandle Handle() const
+		{
+			return m_handle;
+		}
+		
 		typedef boost::shared_ptr<MyConnection> shared_ptr_to_myconnection;
+		typedef latency_recorder::clock_type clock_type;
+		
+		// a received message, valid only until the handler returns
+		typedef boost::string_ref message_view;
+		
+		// Queues "msg" to be sent as one frame. At most one write is in flight;
+		// messages queued meanwhile go out together in the next gather write.
+		// Returns false once the unsent backlog is above WRITE_HIGH_WATERMARK,
+		// the caller should then hold off until writeBacklog() drops.
+		// Must be called on the thread running this connection's io_service.
+		// "msg" is copied into a chunk borrowed from the shard's pool until it
+		// is written, so a message of up to CHUNK_SIZE bytes allocates nothing.
+		bool asyncWrite(message_view msg)
+		{
+			m_pending.push_back(OutgoingMessage());
+			OutgoingMessage& m = m_pending.back();
+			m_chunks.borrow(m.copy);
+			if (msg.size() > m.copy.size())
+				m.copy.resize(msg.size());		// too big to keep, the pool frees it
+			std::copy(msg.begin(), msg.end(), m.copy.begin());
+			m.size = msg.size();
+			
+			return queued();
+		}
+		
+		// Same, without copying "payload": it is only referenced until written,
+		// so one payload may be queued on any number of connections of this
+		// thread.
+		bool asyncWrite(const SharedPayload& payload)
+		{
+			m_pending.push_back(OutgoingMessage());
+			m_pending.back().shared = payload;
+			m_pending.back().size = payload->size();
+			
+			return queued();
+		}
+		
+		std::size_t writeBacklog() const
+		{
+			return m_queuedBytes;
+		}
 		
 	protected: 
+		// A queued message: a publication by reference, anything else copied
+		// into a chunk of m_chunks, which goes back to the pool once written.
+		struct OutgoingMessage
+		{
+			OutgoingMessage() : size(0) {}
+			
+			const char* data() const
+			{
+				return shared ? shared->data() : copy.data();
+			}
+			
+			SharedPayload			shared;
+			std::vector<char>	copy;
+			std::size_t				size;
+		};
+		
 		// memeber variables
 		socket_type								socket;
-		boost::asio::streambuf		stream_buffer;
-		std::string								message;
+		ChunkPool&								m_chunks;
+		bool											m_borrowing;		// m_buffer holds a chunk of m_chunks
+		FlatBuffer								m_buffer;
+		boost::scoped_ptr<FrameCodec>	m_codec;
+		std::size_t								m_needed;		// bytes the frame being received still needs, 0 if unknown
+		std::vector<OutgoingMessage>	m_pending;		// queued, not yet handed to the socket
+		std::vector<OutgoingMessage>	m_inFlight;		// messages of the current write
+		std::vector<std::string>	m_inFlightHeaders;		// their frame headers
+		std::vector<clock_type::time_point>	m_pendingSince;		// when each message was queued
+		std::vector<clock_type::time_point>	m_inFlightSince;
+		std::vector<boost::asio::const_buffer>	m_gather;
+		std::size_t								m_queuedBytes;	// payload bytes pending + in flight
+		bool											m_writing;
+		HandlerAllocator					m_readAllocator;
+		HandlerAllocator					m_writeAllocator;
+		ConnectionRegistry*				m_registry;		// null once unregistered
+		SubscriberRegistry*				m_subscribers;
+		const Publisher*					m_publish;
+		std::vector<std::pair<std::string, SubscriberRegistry::Handle> >	m_subscriptions;
+		admission_control*				m_admission;		// null once released
+		admission_control::address_type	m_peer;
+		ConnectionHandle					m_handle;
+		clock_type::time_point		m_acceptedAt;
+		clock_type::time_point		m_readAt;		// completion of the read being drained
+		bool											m_firstByteSeen;
+		bool											m_echo;		// my_server's line protocol: echo, don't print
+		
+		// Refers to m_gather instead of copying it into the write operation,
+		// which would allocate on every write.
+		struct GatherBuffers
+		{
+			typedef boost::asio::const_buffer value_type;
+			typedef std::vector<boost::asio::const_buffer>::const_iterator const_iterator;
+			
+			const_iterator begin() const { return buffers->begin(); }
+			const_iterator end() const { return buffers->end(); }
+			
+			const std::vector<boost::asio::const_buffer>* buffers;
+		};
 		
 		void asyncRead()
 		{
-			boost::asio::async_read_until(
-						socket, 
-						stream_buffer,
-						'\0',
-						boost::bind(
-							&MyConnection::readHandler,
-							shared_from_this(),
-							boost::asio::placeholders::error,
-							boost::asio::placeholders::bytes_transferred
+			// between messages: give the chunk back and wait until the socket
+			// is readable, an idle connection holds no receive memory
+			if (m_buffer.empty())
+			{
+				giveBackChunk();
+				socket.async_read_some(
+							boost::asio::null_buffers(),
+							makeCustomAllocHandler(m_readAllocator,
+								boost::bind(
+									&MyConnection::readableHandler,
+									shared_from_this(),
+									boost::asio::placeholders::error
+								)
+							)
+				);
+				return;
+			}
+			
+			// the rest of a large frame is read in one go, straight into space
+			// reserved for it; small ones are read along with what follows them
+			if (m_needed > READ_SIZE)
+			{
+				boost::asio::async_read(
+							socket,
+							boost::asio::buffer(m_buffer.prepare(m_needed), m_needed),
+							makeCustomAllocHandler(m_readAllocator,
+								boost::bind(
+									&MyConnection::readHandler,
+									shared_from_this(),
+									boost::asio::placeholders::error,
+									boost::asio::placeholders::bytes_transferred
+								)
+							)
+				);
+				return;
+			}
+			
+			socket.async_read_some(
+						m_buffer.prepare(READ_SIZE),
+						makeCustomAllocHandler(m_readAllocator,
+							boost::bind(
+								&MyConnection::readHandler,
+								shared_from_this(),
+								boost::asio::placeholders::error,
+								boost::asio::placeholders::bytes_transferred
+							)
 						)
 			);
 		}
 		
-		void asyncWrite(const std::string& s)
+		// accounts for the message just added to m_pending and writes it,
+		// unless a write is under way already
+		bool queued()
 		{
-			message = s;
+			m_queuedBytes += m_pending.back().size;
+			m_pendingSince.push_back(clock_type::now());
+			
+			if (!m_writing)
+				startWrite();
+			
+			return m_queuedBytes < WRITE_HIGH_WATERMARK;
+		}
+		
+		void startWrite()
+		{
+			// both vectors keep their capacity, so swapping them allocates nothing
+			m_inFlight.swap(m_pending);
+			m_inFlightSince.clear();
+			m_inFlightSince.swap(m_pendingSince);
+			m_gather.clear();
+			
+			// all headers first: m_gather points into them
+			m_inFlightHeaders.resize(m_inFlight.size());
+			for (std::size_t i = 0; i < m_inFlight.size(); ++i)
+				m_codec->header(m_inFlight[i].size, m_inFlightHeaders[i]);
 			
+			boost::string_ref trailer = m_codec->trailer();
+			for (std::size_t i = 0; i < m_inFlight.size(); ++i)
+			{
+				if (!m_inFlightHeaders[i].empty())
+					m_gather.push_back(boost::asio::buffer(m_inFlightHeaders[i]));
+				m_gather.push_back(boost::asio::buffer(m_inFlight[i].data(), m_inFlight[i].size));
+				if (!trailer.empty())
+					m_gather.push_back(boost::asio::buffer(trailer.data(), trailer.size()));
+			}
+			
+			GatherBuffers buffers = { &m_gather };
+			
+			m_writing = true;
 			boost::asio::async_write(
 						socket,
-						boost::asio::buffer(message.c_str(), message.size() + 1),
-						boost::bind(
-							&MyConnection::writeHandler,
-							shared_from_this(),
-							boost::asio::placeholders::error,
-							boost::asio::placeholders::bytes_transferred
+						buffers,
+						makeCustomAllocHandler(m_writeAllocator,
+							boost::bind(
+								&MyConnection::writeHandler,
+								shared_from_this(),
+								boost::asio::placeholders::error,
+								boost::asio::placeholders::bytes_transferred
+							)
 						)
 			);
 		}
 		
+		// borrows a chunk and reads what is there without blocking
+		void readableHandler(const boost::system::error_code& ec)
+		{
+			if (ec)
+			{
+				unregister();
+				return;
+			}
+			
+			borrowChunk();
+			boost::system::error_code error;
+			std::size_t bytes_transferred = socket.read_some(m_buffer.prepare(READ_SIZE), error);
+			if (error == boost::asio::error::would_block || error == boost::asio::error::try_again)
+			{
+				asyncRead();		// woken up for nothing, wait again
+				return;
+			}
+			
+			readHandler(error, bytes_transferred);
+		}
+		
+		void borrowChunk()
+		{
+			if (!m_borrowing)
+			{
+				std::vector<char> chunk;
+				m_chunks.borrow(chunk);
+				m_buffer.swapStorage(chunk);
+				m_borrowing = true;
+			}
+		}
+		
+		void giveBackChunk()
+		{
+			if (m_borrowing)
+			{
+				std::vector<char> chunk;
+				m_buffer.swapStorage(chunk);
+				m_chunks.giveBack(chunk);
+				m_borrowing = false;
+			}
+		}
+		
 		void readHandler(const boost::system::error_code& ec, 
 											size_t bytes_transferred)
 		{
 			if (!ec)
 			{
-				std::cout << extractString() << std::endl;
+				m_readAt = clock_type::now();
+				if (!m_firstByteSeen)
+				{
+					m_firstByteSeen = true;
+					latency_recorder::instance().record(accept_to_first_byte, m_readAt - m_acceptedAt);
+				}
+				
+				m_buffer.commit(bytes_transferred);
+				if (!drainMessages())
+				{
+					boost::system::error_code ignored;
+					socket.close(ignored);
+					unregister();
+					return;
+				}
 				asyncRead();			// read again
 			}
 			else
 			{
-				// do nothing, "this" will be deleted latter.
+				// "this" will be deleted latter, once the last handler lets go
+				unregister();
 			}
 		}
 		
 		void writeHandler(const boost::system::error_code& ec, 
 												size_t bytes_transferred)
 		{
+			m_writing = false;
+			for (auto& m: m_inFlight)
+				m_queuedBytes -= m.size;
+			release(m_inFlight);
+			
+			if (ec)
+			{
+				// the connection is gone, drop what is still queued
+				release(m_pending);
+				m_pendingSince.clear();
+				m_queuedBytes = 0;
+				return;
+			}
+			
+			clock_type::time_point now = clock_type::now();
+			for (auto queued: m_inFlightSince)
+				latency_recorder::instance().record(handler_to_write_complete, now - queued);
+			
+			if (!m_pending.empty())
+				startWrite();
+		}
+		
+		// gives the chunks of written or dropped messages back to the pool
+		void release(std::vector<OutgoingMessage>& messages)
+		{
+			for (auto& m: messages)
+			{
+				if (!m.shared)
+					m_chunks.giveBack(m.copy);
+			}
+			messages.clear();
+		}
+		
+		// hands every complete frame in the buffer to messageHandler() in
+		// place, then drops it from the buffer; false if the stream is not
+		// framed the way this connection expects
+		bool drainMessages()
+		{
+			for (;;)
+			{
+				message_view payload;
+				std::size_t consumed = 0;
+				
+				switch (m_codec->decode(m_buffer.data(), m_buffer.size(), payload, consumed, m_needed))
+				{
+					case FrameCodec::Incomplete:
+						return true;
+					case FrameCodec::Malformed:
+						return false;
+					case FrameCodec::Complete:
+						break;
+				}
+				
+				m_needed = 0;
+				latency_recorder::instance().record_since(read_to_handler, m_readAt);
+				messageHandler(payload);
+				m_buffer.consume(consumed);
+			}
+		}
+		
+		// "SUB topic", "UNSUB topic" and "PUB topic payload" drive the broadcast
+		// engine, anything else is printed
+		void messageHandler(message_view msg)
+		{
+			if (msg.starts_with("PUB "))
+				publish(msg.substr(4));
+			else if (msg.starts_with("SUB "))
+				subscribe(std::string(msg.begin() + 4, msg.end()));
+			else if (msg.starts_with("UNSUB "))
+				unsubscribe(std::string(msg.begin() + 6, msg.end()));
+			else if (m_echo)
+			{
+				if (!msg.empty())		// blank lines carry nothing
+					asyncWrite(msg);
+			}
+			else
+				std::cout << msg << std::endl;
+		}
+		
+		// "topic payload" is what every subscriber of "topic" receives, as
+		// one frame. It is copied out of the receive buffer once, here; every
+		// shard then queues that same buffer on its subscribers.
+		void publish(message_view publication)
+		{
+			if (!m_publish)
+				return;
+			
+			message_view topic = publication.substr(0, publication.find(' '));
+			SharedPayload payload(boost::make_shared<std::string>(publication.begin(), publication.end()));
+			(*m_publish)(std::string(topic.begin(), topic.end()), payload);
+		}
+		
+		void subscribe(const std::string& topic)
+		{
+			if (!m_subscribers || topic.empty())
+				return;
 			
+			for (auto& s: m_subscriptions)
+			{
+				if (s.first == topic)
+					return;		// once is enough
+			}
+			
+			m_subscriptions.push_back(std::make_pair(topic,
+																m_subscribers->subscribe(topic, shared_from_this())));
 		}
 		
-		std::string extractString()
+		void unsubscribe(const std::string& topic)
 		{
-			std::istream is(&stream_buffer);
-			std::string s;
-			std::getline(is, s, '\0');
-			return s;
+			for (std::size_t i = 0; i < m_subscriptions.size(); ++i)
+			{
+				if (m_subscriptions[i].first == topic)
+				{
+					m_subscribers->unsubscribe(topic, m_subscriptions[i].second);
+					m_subscriptions[i] = m_subscriptions.back();
+					m_subscriptions.pop_back();
+					return;
+				}
+			}
+		}
+		
+		void unregister()
+		{
+			if (m_registry)
+			{
+				m_registry->remove(m_handle.slot);
+				m_registry = nullptr;
+			}
+			
+			// on the shard thread, which owns the pool
+			m_buffer.consume(m_buffer.size());
+			giveBackChunk();
+			
+			if (m_admission)
+			{
+				m_admission->release(m_peer);
+				m_admission = nullptr;
+			}
+			
+			// a closed connection leaves its topics too
+			for (auto& s: m_subscriptions)
+				m_subscribers->unsubscribe(s.first, s.second);
+			m_subscriptions.clear();
 		}
 };
 
-class MyServer
+// One io_service, one thread and one acceptor. A server with several shards binds
+// every shard's acceptor to the same port with SO_REUSEPORT, so the kernel spreads
+// incoming connections across the shards and each connection stays on one thread.
+// A shard given the listening socket of the process it replaces (hot restart)
+// adopts it instead of binding. Its connections frame messages with "framing" and
+// hand what they publish to "publish", which reaches every shard's deliver().
+// With an "admission" control the shard only accepts while it admits more
+// connections, and leaves the others in the listen backlog meanwhile. Its
+// connections borrow receive chunks from the shard's pool and are closed by a
+// frame longer than "maxFrame".
+class MyServerShard
 {
 	public:
-		MyServer() : 
+		MyServerShard(std::size_t index, bool reusePort, int adoptedListener = -1,
+									unsigned short port = PORT, Framing framing = DelimitedFraming,
+									const Publisher& publish = Publisher(),
+									admission_control* admission = nullptr,
+									std::size_t maxFrame = MAX_FRAME_PAYLOAD) : 
+			_index(index),
+			_framing(framing),
+			_maxFrame(maxFrame),
+			_publish(publish),
+			_admission(admission),
+			_chunks(CHUNK_SIZE, MAX_IDLE_CHUNKS),
 			_service(),
 			_work(boost::asio::io_service::work(_service)),
-			_acc(_service, tcp::endpoint(tcp::v4(), PORT)),
-			_thread(boost::bind(&boost::asio::io_service::run, &_service))
-			{}
+			_acc(_service),
+			_accepting(false),
+			_admissionTimer(_service)
+		{
+			tcp::endpoint endpoint(tcp::v4(), port);
 			
-		~MyServer()
+			if (adoptedListener >= 0)
+			{
+				_acc.assign(endpoint.protocol(), adoptedListener);
+				_thread = boost::thread(boost::bind(&MyServerShard::run, this));
+				return;
+			}
+			
+			_acc.open(endpoint.protocol());
+			_acc.set_option(acceptor_type::reuse_address(true));
+			
+			if (reusePort)
+			{
+#ifdef SO_REUSEPORT
+				_acc.set_option(reuse_port(true));
+#else
+				throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+			}
+			
+			_acc.bind(endpoint);
+			_acc.listen();
+			
+			// start the thread only once the acceptor is set up, a throwing
+			// constructor must not leave a joinable thread behind
+			_thread = boost::thread(boost::bind(&MyServerShard::run, this));
+		}
+			
+		~MyServerShard()
 		{
 			stop();
 			_work.reset();
@@ -130,75 +658,434 @@ class MyServer
 		
 		void start()
 		{
-			doAccept();
+			_service.post(boost::bind(&MyServerShard::doAccept, this));
 		}
 		
 		void stop()
 		{
-			_acc.cancel();
+			// the acceptor belongs to the shard thread, so cancel it from there
+			_service.post(boost::bind(&MyServerShard::doStop, this));
 		}
 		
 		void stopAllConnections()
 		{
-			for (auto c: m_connections)
-			{
-				if (auto p = c.lock())
-					p->Stop();
-			}
+			_service.post(boost::bind(&MyServerShard::doStopAllConnections, this));
+		}
+		
+		// runs "fn" on the shard thread with the connection in "slot", if it is still alive
+		void post(ConnectionRegistry::Handle slot, boost::function<void (MyConnection&)> fn)
+		{
+			_service.post(boost::bind(&MyServerShard::doPost, this, slot, fn));
+		}
+		
+		// queues "payload" on every subscriber of "topic" of this shard; callable
+		// from any thread
+		void deliver(const std::string& topic, SharedPayload payload)
+		{
+			_service.post(boost::bind(&MyServerShard::doDeliver, this, topic, payload));
+		}
+		
+		// the listening socket, to hand to the process replacing this one
+		int listener()
+		{
+			return _acc.native_handle();
+		}
+		
+		// live connections; asks the shard thread and waits for the answer
+		std::size_t connectionCount()
+		{
+			boost::promise<std::size_t> count;
+			boost::unique_future<std::size_t> answer = count.get_future();
+			_service.post([this, &count]() { count.set_value(m_connections.size()); });
+			return answer.get();
 		}
 		
 	protected:
+		// the shard thread; its latency histograms are allocated before it
+		// serves, so recording a latency never allocates
+		void run()
+		{
+			latency_recorder::instance().reserve();
+			_service.run();
+		}
+		
 		void acceptHandler(const boost::system::error_code& ec, 
 						MyConnection::shared_ptr_to_myconnection accepted)
 		{
-			if (!ec)
+			_accepting = false;
+			if (ec)
+				return;
+			
+			// the connection takes its place here, or is refused: the other
+			// shards may have taken the last place or token meanwhile
+			if (_admission)
 			{
-				m_connections.push_back(accepted);
-				accepted->Session();
-				
-				doAccept(); 			// call again to listen for new connections
+				boost::system::error_code peerError;
+				tcp::endpoint peer = accepted->Socket().remote_endpoint(peerError);
+				if (peerError || !_admission->admit(peer.address()))
+				{
+					boost::system::error_code ignored;
+					accepted->Socket().close(ignored);
+					doAccept();
+					return;
+				}
+				accepted->Admitted(*_admission, peer.address());
 			}
+			
+			ConnectionHandle handle = { _index, m_connections.insert(accepted) };
+			accepted->Register(m_connections, m_subscribers, _publish, handle);
+			accepted->Session();
+			
+			doAccept(); 			// call again to listen for new connections
 		}
 		
+		// arms the shard's one accept, if it is not armed yet and there is
+		// room: an accept armed while over budget would take a connection
+		// that admit() can only refuse
 		void doAccept()
 		{
-			auto newaccept = boost::make_shared<MyConnection>(_service);
+			if (!_acc.is_open() || _accepting)
+				return;
+			
+			admission_control::clock_type::duration retryAfter;
+			if (_admission && !_admission->may_accept(retryAfter, boost::bind(&MyServerShard::resumeAccept, this)))
+			{
+				// over budget: stop accepting until a token is due, or until
+				// a connection closes and resumeAccept() is called
+				if (retryAfter > admission_control::clock_type::duration::zero())
+				{
+					_admissionTimer.expires_from_now(retryAfter);
+					_admissionTimer.async_wait(boost::bind(&MyServerShard::admissionTimerHandler, this,
+																								boost::asio::placeholders::error));
+				}
+				return;
+			}
+			
+			auto newaccept = boost::make_shared<MyConnection>(boost::ref(_service), boost::ref(_chunks),
+																												_framing, _maxFrame);
+			_accepting = true;
 			_acc.async_accept(
 							newaccept->Socket(),
-							boost::bind(&MyServer::acceptHandler,
-											this,
-											boost::asio::placeholders::error,
-											newaccept
+							makeCustomAllocHandler(_acceptAllocator,
+								boost::bind(&MyServerShard::acceptHandler,
+												this,
+												boost::asio::placeholders::error,
+												newaccept
+								)
 							)
 			);
 		}
 		
+		// from the thread releasing a connection
+		void resumeAccept()
+		{
+			_service.post(boost::bind(&MyServerShard::doAccept, this));
+		}
+		
+		void admissionTimerHandler(const boost::system::error_code& ec)
+		{
+			if (!ec)
+				doAccept();
+		}
+		
+		void doStop()
+		{
+			// closing only drops our descriptor; after a hot restart the
+			// listening socket lives on in the new process
+			boost::system::error_code ec;
+			_acc.close(ec);
+			_admissionTimer.cancel(ec);
+		}
+		
+		void doStopAllConnections()
+		{
+			// only live connections are visited, closed ones left the registry
+			for (auto c: m_connections)
+			{
+				if (auto p = c.lock())
+					p->Stop();
+			}
+		}
+		
+		void doDeliver(const std::string& topic, const SharedPayload& payload)
+		{
+			SubscriberRegistry::Subscribers* subscribers = m_subscribers.find(topic);
+			if (!subscribers)
+				return;
+			
+			// a subscriber that does not keep up misses publications instead of
+			// queueing them without bound
+			for (auto c: *subscribers)
+			{
+				auto p = c.lock();
+				if (p && p->writeBacklog() < WRITE_HIGH_WATERMARK)
+					p->asyncWrite(payload);
+			}
+		}
+		
+		void doPost(ConnectionRegistry::Handle slot, boost::function<void (MyConnection&)> fn)
+		{
+			boost::weak_ptr<MyConnection>* c = m_connections.find(slot);
+			if (!c)
+				return;
+			
+			if (auto p = c->lock())
+				fn(*p);
+		}
+		
 	protected:
+		std::size_t																				_index;
+		Framing																						_framing;
+		std::size_t																				_maxFrame;
+		Publisher																					_publish;
+		admission_control*																_admission;
+		ChunkPool																					_chunks;		// outlives the connections
 		boost::asio::io_service 													_service;
 		boost::optional<boost::asio::io_service::work> 		_work;
 		acceptor_type																			_acc;
+		bool																							_accepting;		// an async_accept is outstanding
+		boost::asio::steady_timer													_admissionTimer;		// paused by the accept rate
+		HandlerAllocator																	_acceptAllocator;
 		boost::thread																			_thread;
 		
 	public:
-		std::list<boost::weak_ptr<MyConnection> > m_connections;
+		ConnectionRegistry m_connections;
+		SubscriberRegistry m_subscribers;
+};
+
+class MyServer
+{
+	public:
+		// shards == 1 keeps the classic single io_service server; every listener
+		// (port) is a server of its own and picks its own framing. "limits" are
+		// shared by all shards; by default there are none. A frame longer than
+		// "maxFrame" closes its connection.
+		explicit MyServer(std::size_t shards = 1, unsigned short port = PORT,
+											Framing framing = DelimitedFraming,
+											const admission_limits& limits = admission_limits(),
+											std::size_t maxFrame = MAX_FRAME_PAYLOAD) :
+			_admission(limits)
+		{
+			for (std::size_t i = 0; i < shards; ++i)
+				_shards.push_back(boost::make_shared<MyServerShard>(i, shards > 1, -1, port, framing,
+																													publisher(), &_admission, maxFrame));
+		}
+		
+		// hot restart: one shard per listening socket taken over from the old process
+		explicit MyServer(const std::vector<int>& adoptedListeners, Framing framing = DelimitedFraming,
+											const admission_limits& limits = admission_limits(),
+											std::size_t maxFrame = MAX_FRAME_PAYLOAD) :
+			_admission(limits)
+		{
+			for (std::size_t i = 0; i < adoptedListeners.size(); ++i)
+				_shards.push_back(boost::make_shared<MyServerShard>(i, false, adoptedListeners[i], PORT,
+																													framing, publisher(), &_admission,
+																													maxFrame));
+		}
+			
+		~MyServer()
+		{
+			_admission.close();		// no shard is resumed from now on
+			stop();
+			_shards.clear();			// each shard joins its own thread
+		}
+		
+		void start()
+		{
+			for (auto& shard: _shards)
+				shard->start();
+		}
+		
+		void stop()
+		{
+			for (auto& shard: _shards)
+				shard->stop();
+		}
+		
+		void stopAllConnections()
+		{
+			for (auto& shard: _shards)
+				shard->stopAllConnections();
+		}
+		
+		std::size_t shardCount() const
+		{
+			return _shards.size();
+		}
+		
+		std::vector<int> listeners()
+		{
+			std::vector<int> fds;
+			for (auto& shard: _shards)
+				fds.push_back(shard->listener());
+			return fds;
+		}
+		
+		std::size_t connectionCount()
+		{
+			std::size_t count = 0;
+			for (auto& shard: _shards)
+				count += shard->connectionCount();
+			return count;
+		}
+		
+		admission_control::admission_stats admissionStats()
+		{
+			return _admission.stats();
+		}
+		
+		// latencies recorded by all shards so far, merged; callable from any thread
+		latency_snapshot latencySnapshot() const
+		{
+			return latency_recorder::instance().snapshot();
+		}
+		
+		// runs "fn" with the connection named by "handle" on the thread that owns it;
+		// nothing happens if the connection closed in the meantime
+		void post(ConnectionHandle handle, boost::function<void (MyConnection&)> fn)
+		{
+			_shards.at(handle.shard)->post(handle.slot, fn);
+		}
+		
+		// Fan-out: queues "payload" on every subscriber of "topic" on every shard,
+		// each shard on its own thread. Callable from any thread; one publisher's
+		// publications reach each subscriber in the order they were published.
+		void publish(const std::string& topic, SharedPayload payload)
+		{
+			for (auto& shard: _shards)
+				shard->deliver(topic, payload);
+		}
+		
+	protected:
+		Publisher publisher()
+		{
+			return boost::bind(&MyServer::publish, this, _1, _2);
+		}
+		
+		admission_control															_admission;		// outlives the shards
+		std::vector<boost::shared_ptr<MyServerShard> >	_shards;
 };
 									
-int main()
+#ifndef ASYNC_SERVER_NO_MAIN		// allocation_check.cpp brings its own main()
+
+// Hot restart: takes over the listening sockets of the process serving
+// "handoffPath", if there is one, and serves them on "handoffPath" in turn.
+// Once a newer process has taken them, stops accepting, gives the live
+// connections up to DRAIN_SECONDS to finish and returns.
+//
+// Both ports are handed over, in a fixed order: the shards' listeners of
+// PORT, then those of FRAMED_PORT. Both servers have the same number of
+// shards, so the first half of what the old process sends is PORT.
+int serveWithHandoff(std::size_t shards, const std::string& handoffPath, Framing framing,
+										 const admission_limits& limits)
+{
+	listener_handoff_client predecessor(handoffPath);
+	const std::vector<int>& adopted = predecessor.descriptors();
+	if (adopted.size() % 2 != 0)
+	{
+		std::cerr << "previous process has " << adopted.size() << " listeners, expected both ports' shards\n";
+		return 1;
+	}
+	
+	std::vector<int> adoptedPort(adopted.begin(), adopted.begin() + adopted.size() / 2);
+	std::vector<int> adoptedFramed(adopted.begin() + adopted.size() / 2, adopted.end());
+	
+	boost::scoped_ptr<MyServer> s(adopted.empty()
+									? new MyServer(shards, PORT, framing, limits)
+									: new MyServer(adoptedPort, framing, limits));
+	boost::scoped_ptr<MyServer> framed(adopted.empty()
+									? new MyServer(shards, FRAMED_PORT, VarintFraming, limits)
+									: new MyServer(adoptedFramed, VarintFraming, limits));
+	s->start();
+	framed->start();
+	predecessor.acknowledge();		// the old process stops accepting now
+	
+	std::cerr << (adopted.empty() ? "Listening on ports " : "Took over ports ") << PORT << " and " << FRAMED_PORT
+						<< " with " << s->shardCount() << " shard(s) each, handoff on " << handoffPath << "\n";
+	
+	std::vector<int> listeners = s->listeners();
+	std::vector<int> framedListeners = framed->listeners();
+	listeners.insert(listeners.end(), framedListeners.begin(), framedListeners.end());
+	
+	// returns once a newer process has our listeners
+	boost::asio::io_service handoffService;
+	listener_handoff_server successor(handoffService, handoffPath, listeners,
+																		[&s, &framed]() { s->stop(); framed->stop(); });
+	handoffService.run();
+	
+	std::cerr << "Handed off, draining " << s->connectionCount() + framed->connectionCount() << " connection(s)\n";
+	for (int i = 0; i < DRAIN_SECONDS * 10 && s->connectionCount() + framed->connectionCount() > 0; ++i)
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+	
+	s->stopAllConnections();		// whatever outlived the drain
+	framed->stopAllConnections();
+	return 0;
+}
+									
+int main(int argc, char* argv[])
 {
 	try
 	{
+		// options first:
+		//   --echo          port PORT speaks my_server's line protocol and
+		//                   echoes, instead of taking '\0' delimited messages
+		//   --duration s    serve s seconds, 0 until killed (default 20)
+		Framing framing = DelimitedFraming;
+		unsigned long duration = 20;
+		int arg = 1;
+		for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg)
+		{
+			if (std::strcmp(argv[arg], "--echo") == 0)
+				framing = LineFraming;
+			else if (std::strcmp(argv[arg], "--duration") == 0 && arg + 1 < argc)
+				duration = std::strtoul(argv[++arg], nullptr, 10);
+			else
+			{
+				std::cerr << "Usage: async_server [--echo] [--duration seconds] [shards] [handoff-path]\n";
+				return 1;
+			}
+		}
+		
+		// optional 1st argument: number of io_service shards, 0 means one per core
+		std::size_t shards = 1;
+		if (argc > arg)
+			shards = std::strtoul(argv[arg], nullptr, 10);
+		if (shards == 0)
+			shards = std::max(1u, boost::thread::hardware_concurrency());
+		
+		admission_limits limits;
+		limits.max_connections = MAX_CONNECTIONS;
+		limits.accept_rate = ACCEPT_RATE;
+		limits.accept_burst = ACCEPT_BURST;
 		
-		MyServer s;
+		// optional 2nd argument: unix socket path for hot restarts, the server
+		// then runs until a new process started with the same path replaces it
+		if (argc > arg + 1)
+			return serveWithHandoff(shards, argv[arg + 1], framing, limits);
+		
+		MyServer s(shards, PORT, framing, limits);
+		MyServer framed(shards, FRAMED_PORT, VarintFraming, limits);
 		s.start();
+		framed.start();
 
-		std::cerr << "Shutdown in 20 seconds.............\n";
+		std::cerr << "Listening on port " << PORT << (framing == LineFraming ? " (line echo) and " : " ('\\0' delimited) and ")
+							<< FRAMED_PORT << " (varint length prefix) with " << s.shardCount() << " shard(s) each\n";
+		if (duration > 0)
+			std::cerr << "Shutdown in " << duration << " seconds.............\n";
 	
-		boost::this_thread::sleep_for(boost::chrono::seconds(20));
+		// dump the latency histograms every 5 seconds while serving
+		for (unsigned long served = 0; duration == 0 || served < duration; served += 5)
+		{
+			unsigned long nap = duration == 0 ? 5 : std::min(5ul, duration - served);
+			boost::this_thread::sleep_for(boost::chrono::seconds(nap));
+			s.latencySnapshot().print(std::cerr);
+		}
 	
 		std::cerr << "Shutdown............\n";
 	
 		s.stopAllConnections();		// interrupt ongoing connections!!!
-	} 					// destructor of the server will join the service thread
+		framed.stopAllConnections();
+	} 					// destructor of the server will join the service threads
 	catch (std::exception& e)
 	{
 		std::cerr << "Exception: " << e.what() << std::endl;
@@ -206,4 +1093,6 @@ int main()
 	}
 	
 	return 0;
-}
\ No newline at end of file
+}
+
+#endif	// ASYNC_SERVER_NO_MAIN
@@ -0,0 +1,73 @@
+#ifndef CHUNK_POOL_HPP
+#define CHUNK_POOL_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Fixed-size receive chunks, lent to connections while they receive.
+//
+// A connection borrows a chunk when its socket becomes readable and gives it
+// back as soon as it has no partial message left, so memory follows the
+// connections that are receiving, not the ones that are open. Returned chunks
+// are kept for the next borrower, up to maxIdle of them; a chunk that grew
+// past chunkSize (a large message) is freed instead.
+//
+// Not thread safe: each shard has one pool for its connections.
+class ChunkPool
+{
+	public:
+		ChunkPool(std::size_t chunkSize, std::size_t maxIdle) :
+			m_chunkSize(chunkSize),
+			m_maxIdle(maxIdle),
+			m_borrowed(0)
+		{}
+
+		// puts a chunk of chunkSize bytes into the empty "chunk"
+		void borrow(std::vector<char>& chunk)
+		{
+			if (m_idle.empty())
+				chunk.resize(m_chunkSize);
+			else
+			{
+				chunk.swap(m_idle.back());
+				m_idle.pop_back();
+			}
+			m_borrowed++;
+		}
+
+		// takes the chunk back out of "chunk", which is left empty
+		void giveBack(std::vector<char>& chunk)
+		{
+			m_borrowed--;
+			if (chunk.size() == m_chunkSize && m_idle.size() < m_maxIdle)
+			{
+				m_idle.push_back(std::vector<char>());
+				m_idle.back().swap(chunk);
+			}
+			else
+				std::vector<char>().swap(chunk);
+		}
+
+		std::size_t chunkSize() const
+		{
+			return m_chunkSize;
+		}
+
+		std::size_t borrowed() const
+		{
+			return m_borrowed;
+		}
+
+		std::size_t idle() const
+		{
+			return m_idle.size();
+		}
+
+	protected:
+		std::size_t											m_chunkSize;
+		std::size_t											m_maxIdle;
+		std::size_t											m_borrowed;
+		std::vector<std::vector<char> >	m_idle;
+};
+
+#endif
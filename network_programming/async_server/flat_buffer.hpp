@@ -0,0 +1,92 @@
+#ifndef FLAT_BUFFER_HPP
+#define FLAT_BUFFER_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Contiguous receive buffer: [0, _begin) is consumed, [_begin, _end) holds
+// received bytes not yet consumed and [_end, capacity) is free for the next
+// read. Unconsumed bytes are never split, so a complete message can always be
+// handed out as one pointer/size view and consumed in place.
+//
+// While empty the buffer can hand its storage back (see ChunkPool), so an idle
+// connection holds no receive memory.
+class FlatBuffer
+{
+	public:
+		explicit FlatBuffer(std::size_t capacity = 4096) :
+			m_storage(capacity),
+			m_begin(0),
+			m_end(0)
+		{}
+
+		// free space of at least "size" bytes for the next read; compacts or grows
+		boost::asio::mutable_buffers_1 prepare(std::size_t size)
+		{
+			if (m_storage.size() - m_end < size)
+			{
+				// move the unconsumed tail to the front before growing
+				std::size_t used = m_end - m_begin;
+				if (m_begin > 0)
+				{
+					std::memmove(&m_storage[0], &m_storage[m_begin], used);
+					m_begin = 0;
+					m_end = used;
+				}
+				if (m_storage.size() - m_end < size)
+					m_storage.resize(m_end + size);
+			}
+			return boost::asio::buffer(&m_storage[m_end], m_storage.size() - m_end);
+		}
+
+		// "size" bytes were written into the space returned by prepare()
+		void commit(std::size_t size)
+		{
+			m_end += size;
+		}
+
+		// "size" bytes at the front were processed
+		void consume(std::size_t size)
+		{
+			m_begin += size;
+			if (m_begin == m_end)
+				m_begin = m_end = 0;			// cheap reset, nothing to move
+		}
+
+		const char* data() const
+		{
+			return m_storage.data() + m_begin;
+		}
+
+		std::size_t size() const
+		{
+			return m_end - m_begin;
+		}
+
+		std::size_t capacity() const
+		{
+			return m_storage.size();
+		}
+
+		bool empty() const
+		{
+			return m_begin == m_end;
+		}
+
+		// exchanges the storage with "storage"; only while empty(), so no
+		// unconsumed bytes go with it
+		void swapStorage(std::vector<char>& storage)
+		{
+			m_storage.swap(storage);
+			m_begin = m_end = 0;
+		}
+
+	protected:
+		std::vector<char>	m_storage;
+		std::size_t				m_begin;
+		std::size_t				m_end;
+};
+
+#endif
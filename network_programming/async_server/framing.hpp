@@ -0,0 +1,293 @@
+#ifndef FRAMING_HPP
+#define FRAMING_HPP
+
+#include <boost/utility/string_ref.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// How a connection cuts its byte stream into messages, and frames the
+// messages it sends. Every connection owns its codec, which may keep state
+// between decode() calls.
+//
+//   DelimitedFraming    message '\0'; payloads cannot contain '\0' and every
+//                       received byte is scanned once
+//   LineFraming         my_server's line protocol: a message ends at '\n' or
+//                       '\r', replies go out as they are, without a line end
+//   VarintFraming       LEB128 length, then that many payload bytes
+//   Fixed32Framing      4 byte big-endian length, then the payload
+//
+// The length-prefixed codecs never look at payload bytes and carry binary
+// payloads. Once a header is decoded they report how many bytes the frame
+// still needs, so the connection can read the rest of a large frame in one go
+// into space reserved for it. Every codec reports a frame longer than its
+// maxPayload as Malformed, so a peer cannot make a connection buffer more.
+enum Framing
+{
+	DelimitedFraming,
+	LineFraming,
+	VarintFraming,
+	Fixed32Framing
+};
+
+class FrameCodec
+{
+	public:
+		enum Status
+		{
+			Complete,		// "payload" and "consumed" are set
+			Incomplete,		// "needed" more bytes at least, 0 if not known yet
+			Malformed		// the stream cannot be decoded, drop the connection
+		};
+
+		virtual ~FrameCodec() {}
+
+		// looks for one frame at the front of [data, data + size); "payload"
+		// points into "data"
+		virtual Status decode(const char* data, std::size_t size,
+													boost::string_ref& payload, std::size_t& consumed,
+													std::size_t& needed) = 0;
+
+		// bytes to send before a payload of "size" bytes, into "header"
+		virtual void header(std::size_t size, std::string& header) const = 0;
+
+		// bytes to send after every payload
+		virtual boost::string_ref trailer() const = 0;
+};
+
+class DelimitedCodec : public FrameCodec
+{
+	public:
+		explicit DelimitedCodec(std::size_t maxPayload) :
+			m_maxPayload(maxPayload),
+			m_scanned(0)
+		{}
+
+		Status decode(const char* data, std::size_t size,
+									boost::string_ref& payload, std::size_t& consumed,
+									std::size_t& needed)
+		{
+			const void* end = std::memchr(data + m_scanned, '\0', size - m_scanned);
+			if (!end)
+			{
+				if (size > m_maxPayload)
+					return Malformed;		// no '\0' within maxPayload bytes
+
+				m_scanned = size;		// don't scan these bytes again
+				needed = 0;
+				return Incomplete;
+			}
+
+			std::size_t length = static_cast<const char*>(end) - data;
+			if (length > m_maxPayload)
+				return Malformed;
+
+			payload = boost::string_ref(data, length);
+			consumed = length + 1;
+			m_scanned = 0;
+			return Complete;
+		}
+
+		void header(std::size_t, std::string& header) const
+		{
+			header.clear();
+		}
+
+		boost::string_ref trailer() const
+		{
+			return boost::string_ref("", 1);		// the '\0'
+		}
+
+	private:
+		std::size_t m_maxPayload;
+		std::size_t m_scanned;		// leading bytes of the input known to hold no '\0'
+};
+
+// Splits lines the way my_server's worker() does, except that a '\0' is an
+// ordinary byte of the line here, where worker() drops the rest of the read.
+// A run of line ends decodes as one empty payload, which carries nothing.
+class LineCodec : public FrameCodec
+{
+	public:
+		explicit LineCodec(std::size_t maxPayload) :
+			m_maxPayload(maxPayload),
+			m_scanned(0)
+		{}
+
+		Status decode(const char* data, std::size_t size,
+									boost::string_ref& payload, std::size_t& consumed,
+									std::size_t& needed)
+		{
+			std::size_t blank = 0;
+			while (blank < size && isLineEnd(data[blank]))
+				++blank;
+			if (blank > 0)
+			{
+				payload = boost::string_ref(data, 0);
+				consumed = blank;
+				m_scanned = 0;
+				return Complete;
+			}
+
+			for (std::size_t i = m_scanned; i < size; ++i)
+			{
+				if (isLineEnd(data[i]))
+				{
+					if (i > m_maxPayload)
+						return Malformed;
+
+					payload = boost::string_ref(data, i);
+					consumed = i + 1;
+					m_scanned = 0;
+					return Complete;
+				}
+			}
+
+			if (size > m_maxPayload)
+				return Malformed;		// no line end within maxPayload bytes
+
+			m_scanned = size;		// don't scan these bytes again
+			needed = 0;
+			return Incomplete;
+		}
+
+		void header(std::size_t, std::string& header) const
+		{
+			header.clear();
+		}
+
+		boost::string_ref trailer() const
+		{
+			return boost::string_ref();
+		}
+
+	private:
+		static bool isLineEnd(char c)
+		{
+			return c == '\n' || c == '\r';
+		}
+
+		std::size_t m_maxPayload;
+		std::size_t m_scanned;		// leading bytes of the input known to hold no line end
+};
+
+class LengthPrefixCodec : public FrameCodec
+{
+	public:
+		// varint: LEB128 length prefix, otherwise 4 bytes big-endian. Frames
+		// announcing more than maxPayload bytes are Malformed.
+		LengthPrefixCodec(bool varint, std::size_t maxPayload) :
+			m_varint(varint),
+			m_maxPayload(maxPayload)
+		{}
+
+		Status decode(const char* data, std::size_t size,
+									boost::string_ref& payload, std::size_t& consumed,
+									std::size_t& needed)
+		{
+			std::uint64_t length = 0;
+			std::size_t headerSize = 0;
+
+			Status status = m_varint
+				? decodeVarint(data, size, length, headerSize)
+				: decodeFixed32(data, size, length, headerSize);
+			if (status == Incomplete)
+			{
+				needed = 0;
+				return Incomplete;
+			}
+			if (status == Malformed || length > m_maxPayload)
+				return Malformed;
+
+			if (size - headerSize < length)
+			{
+				needed = headerSize + length - size;
+				return Incomplete;
+			}
+
+			payload = boost::string_ref(data + headerSize, length);
+			consumed = headerSize + length;
+			return Complete;
+		}
+
+		void header(std::size_t size, std::string& header) const
+		{
+			header.clear();
+			if (m_varint)
+			{
+				std::uint64_t value = size;
+				do
+				{
+					char byte = static_cast<char>(value & 0x7f);
+					value >>= 7;
+					header.push_back(value ? static_cast<char>(byte | 0x80) : byte);
+				}
+				while (value);
+			}
+			else
+			{
+				if (static_cast<std::uint64_t>(size) > 0xffffffffu)
+					throw std::length_error("payload too large for a 32 bit length prefix");
+				for (int shift = 24; shift >= 0; shift -= 8)
+					header.push_back(static_cast<char>((size >> shift) & 0xff));
+			}
+		}
+
+		boost::string_ref trailer() const
+		{
+			return boost::string_ref();
+		}
+
+	private:
+		// a 64 bit LEB128 value takes at most 10 bytes
+		static const std::size_t MAX_VARINT_SIZE = 10;
+
+		static Status decodeVarint(const char* data, std::size_t size,
+															 std::uint64_t& length, std::size_t& headerSize)
+		{
+			unsigned shift = 0;
+			for (std::size_t i = 0; i < size && i < MAX_VARINT_SIZE; ++i, shift += 7)
+			{
+				unsigned char byte = static_cast<unsigned char>(data[i]);
+				if (i == MAX_VARINT_SIZE - 1 && byte > 1)
+					return Malformed;		// the 10th byte holds bit 63 only and ends the varint
+				length |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+				if (!(byte & 0x80))
+				{
+					headerSize = i + 1;
+					return Complete;
+				}
+			}
+			return size >= MAX_VARINT_SIZE ? Malformed : Incomplete;
+		}
+
+		static Status decodeFixed32(const char* data, std::size_t size,
+																std::uint64_t& length, std::size_t& headerSize)
+		{
+			if (size < 4)
+				return Incomplete;
+
+			const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+			length = (std::uint64_t(bytes[0]) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+			headerSize = 4;
+			return Complete;
+		}
+
+		bool				m_varint;
+		std::size_t	m_maxPayload;
+};
+
+inline FrameCodec* makeFrameCodec(Framing framing, std::size_t maxPayload)
+{
+	switch (framing)
+	{
+		case VarintFraming:		return new LengthPrefixCodec(true, maxPayload);
+		case Fixed32Framing:	return new LengthPrefixCodec(false, maxPayload);
+		case LineFraming:			return new LineCodec(maxPayload);
+		default:							return new DelimitedCodec(maxPayload);
+	}
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef HANDLER_ALLOCATOR_HPP
+#define HANDLER_ALLOCATOR_HPP
+
+#include <boost/aligned_storage.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Memory for the state of one asynchronous operation at a time. Asio releases
+// an operation's memory before calling its handler, so an object that keeps
+// one operation of a kind outstanding (a connection's read, its write, an
+// acceptor's accept) reuses the same block for every operation and allocates
+// nothing in steady state. A second concurrent operation, or one bigger than
+// the block, falls back to the heap.
+class HandlerAllocator : private boost::noncopyable
+{
+	public:
+		HandlerAllocator() : m_inUse(false)
+		{}
+
+		void* allocate(std::size_t size)
+		{
+			if (!m_inUse && size <= sizeof(m_storage))
+			{
+				m_inUse = true;
+				return m_storage.address();
+			}
+
+			return ::operator new(size);
+		}
+
+		void deallocate(void* pointer)
+		{
+			if (pointer == m_storage.address())
+				m_inUse = false;
+			else
+				::operator delete(pointer);
+		}
+
+	protected:
+		boost::aligned_storage<1024>	m_storage;
+		bool													m_inUse;
+};
+
+// Wraps a handler so asio's custom allocation hooks, asio_handler_allocate()
+// and asio_handler_deallocate(), take the operation's memory from a
+// HandlerAllocator. Composed operations such as async_write forward the hooks
+// of their handler, so the wrapper covers them as well.
+template <typename Handler>
+class CustomAllocHandler
+{
+	public:
+		CustomAllocHandler(HandlerAllocator& allocator, Handler handler) :
+			m_allocator(allocator),
+			m_handler(handler)
+		{}
+
+		template <typename... Args>
+		void operator()(Args&&... args)
+		{
+			m_handler(std::forward<Args>(args)...);
+		}
+
+		friend void* asio_handler_allocate(std::size_t size,
+											CustomAllocHandler<Handler>* thisHandler)
+		{
+			return thisHandler->m_allocator.allocate(size);
+		}
+
+		friend void asio_handler_deallocate(void* pointer, std::size_t /*size*/,
+											CustomAllocHandler<Handler>* thisHandler)
+		{
+			thisHandler->m_allocator.deallocate(pointer);
+		}
+
+	protected:
+		HandlerAllocator&	m_allocator;
+		Handler						m_handler;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> makeCustomAllocHandler(HandlerAllocator& allocator,
+																													Handler handler)
+{
+	return CustomAllocHandler<Handler>(allocator, handler);
+}
+
+#endif
@@ -0,0 +1,440 @@
+// Fan-out benchmark for async_server's broadcast engine: for every subscriber
+// count, opens that many connections subscribed to one topic, publishes to it
+// from one more connection and times the deliveries.
+//
+// usage: pubsub_benchmark [--option value]...
+//
+//   --host         server address                             (127.0.0.1)
+//   --port         server port, '\0' framing                  (11235)
+//   --subscribers  subscriber counts, one round each,
+//                  comma separated                            (1,10,100,1000,10000)
+//   --messages     publications per round                     (1000)
+//   --size         payload bytes                              (64)
+//   --window       publications not yet delivered to every
+//                  subscriber before the next one is sent     (1)
+//   --timeout      seconds a round may take                   (300)
+//
+// Prints one CSV line per round:
+//   fan-out latency    publication sent -> its last subscriber received it
+//   delivery latency   publication sent -> one subscriber received it
+//
+// With --window > 1 a subscriber the server finds over its write high
+// watermark misses publications; such a round ends at --timeout and reports
+// complete=0. Every connection needs a descriptor on both ends: run the server
+// and the benchmark with "ulimit -n" above the largest subscriber count.
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "../common/latency_histogram.hpp"
+
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock	clock_type;
+
+// connects in flight at once, more would overflow the server's listen backlog
+const size_t CONNECT_WINDOW = 256;
+
+struct options
+{
+	options() :
+		host("127.0.0.1"),
+		port(11235),
+		subscribers("1,10,100,1000,10000"),
+		messages(1000),
+		size(64),
+		window(1),
+		timeout(300)
+	{}
+
+	std::string		host;
+	unsigned short	port;
+	std::string		subscribers;
+	size_t			messages;
+	size_t			size;
+	size_t			window;
+	double			timeout;
+};
+
+class fan_out_round;
+
+/**
+ * one subscribed connection; counts what it receives into its round
+ */
+class subscriber : public boost::enable_shared_from_this<subscriber>
+{
+	public:
+		subscriber(boost::asio::io_service &io_service, fan_out_round &round) :
+			socket(io_service),
+			round(round),
+			probed(false)
+		{}
+
+		void start(const std::string &topic)
+		{
+			subscription = "SUB " + topic + std::string(1, '\0');
+			boost::asio::async_write(socket, boost::asio::buffer(subscription),
+				boost::bind(&subscriber::subscribed, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		tcp::socket		socket;
+
+	private:
+		void subscribed(const boost::system::error_code &error)
+		{
+			if (!error)
+				read();
+		}
+
+		void read()
+		{
+			socket.async_read_some(boost::asio::buffer(buffer),
+				boost::bind(&subscriber::received, shared_from_this(),
+					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+		}
+
+		void received(const boost::system::error_code &error, size_t bytes);
+
+		fan_out_round	&round;
+		std::string		subscription;
+		std::string		partial;		// start of a message cut by the end of a read
+		char			buffer[16384];
+		bool			probed;			// saw a probe, so the server knows us
+};
+
+/**
+ * one subscriber count: connect, subscribe, wait until every subscriber gets
+ * publications, then publish "messages" of them through a window
+ */
+class fan_out_round
+{
+	public:
+		fan_out_round(boost::asio::io_service &io_service, const options &opts, size_t subscribers, size_t number) :
+			io_service(io_service),
+			opts(opts),
+			topic("bench" + std::to_string(number)),
+			publisher(io_service),
+			timer(io_service),
+			subscriber_count(subscribers),
+			connected(0),
+			ready(0),
+			sent(0),
+			completed(0),
+			writing(false),
+			measuring(false),
+			received_by(opts.messages, 0),
+			sent_at(opts.messages)
+		{}
+
+		/**
+		 * runs the round to the end; false if it timed out
+		 */
+		bool run()
+		{
+			tcp::resolver resolver(io_service);
+			endpoint = *resolver.resolve(tcp::resolver::query(opts.host, std::to_string(opts.port)));
+			publisher.connect(endpoint);
+
+			for (size_t i = 0; i < subscriber_count && i < CONNECT_WINDOW; i++)
+				connect_next();
+
+			timer.expires_from_now(std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(opts.timeout)));
+			timer.async_wait([this](const boost::system::error_code &error) { if (!error) finish(); });
+
+			io_service.run();
+			io_service.reset();
+			return completed == opts.messages;
+		}
+
+		/**
+		 * a subscriber got "message", "topic sequence padding" or "topic probe"
+		 */
+		void delivered(const char *message, size_t size, bool &probed)
+		{
+			clock_type::time_point now = clock_type::now();
+			const char *sequence = static_cast<const char*>(std::memchr(message, ' ', size));
+			if (!sequence || sequence + 1 == message + size)
+				return;
+			sequence++;
+
+			if (*sequence == 'p')
+			{
+				if (!probed)
+				{
+					probed = true;
+					if (++ready == subscriber_count)
+						start_measuring();
+				}
+				return;
+			}
+
+			size_t n = std::strtoul(sequence, nullptr, 10);
+			if (!measuring || n >= opts.messages)
+				return;
+
+			delivery.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_at[n]).count());
+			if (++received_by[n] < subscriber_count)
+				return;
+
+			fan_out.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_at[n]).count());
+			if (++completed == opts.messages)
+				finish();
+			else if (sent < opts.messages)
+				publish(sent++);
+		}
+
+		void print(bool complete) const
+		{
+			double seconds = std::chrono::duration<double>(finished_at - started_at).count();
+			std::printf("%zu,%zu,%zu,%zu,%zu,%.3f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%d\n",
+				subscriber_count, opts.messages, opts.size, opts.window, completed, seconds,
+				delivery.count() / seconds,
+				fan_out.percentile(50) / 1e3, fan_out.percentile(99) / 1e3, fan_out.max() / 1e3,
+				delivery.percentile(50) / 1e3, delivery.percentile(99) / 1e3, complete ? 1 : 0);
+		}
+
+	private:
+		void connect_next()
+		{
+			boost::shared_ptr<subscriber> s = boost::make_shared<subscriber>(boost::ref(io_service), boost::ref(*this));
+			subscribers.push_back(s);
+			s->socket.async_connect(endpoint, [this, s](const boost::system::error_code &error)
+			{
+				if (error)
+				{
+					if (error != boost::asio::error::operation_aborted)
+						std::fprintf(stderr, "connect: %s\n", error.message().c_str());
+					finish();
+					return;
+				}
+
+				s->start(topic);
+				if (subscribers.size() < subscriber_count)
+					connect_next();
+				if (++connected == subscriber_count)
+					probe();
+			});
+		}
+
+		/**
+		 * SUBs are handled by the subscribers' shards, in no particular order
+		 * with our PUBs: publish probes until every subscriber has seen one
+		 */
+		void probe()
+		{
+			if (measuring || finished_at != clock_type::time_point())
+				return;
+
+			send("PUB " + topic + " probe");
+			probe_timer.reset(new boost::asio::steady_timer(io_service, std::chrono::milliseconds(10)));
+			probe_timer->async_wait([this](const boost::system::error_code &error) { if (!error) probe(); });
+		}
+
+		void start_measuring()
+		{
+			measuring = true;
+			started_at = clock_type::now();
+			while (sent < opts.window && sent < opts.messages)
+				publish(sent++);
+		}
+
+		void publish(size_t n)
+		{
+			std::string message = "PUB " + topic + " " + std::to_string(n) + " ";
+			if (message.size() < 4 + topic.size() + 1 + opts.size)
+				message.append(4 + topic.size() + 1 + opts.size - message.size(), 'x');
+
+			sent_at[n] = clock_type::now();
+			send(message);
+		}
+
+		void send(const std::string &message)
+		{
+			queued.append(message);
+			queued.push_back('\0');
+			if (!writing)
+				write();
+		}
+
+		void write()
+		{
+			writing = true;
+			in_flight.swap(queued);
+			queued.clear();
+			boost::asio::async_write(publisher, boost::asio::buffer(in_flight),
+				[this](const boost::system::error_code &error, size_t)
+				{
+					writing = false;
+					if (error)
+						finish();
+					else if (!queued.empty())
+						write();
+				});
+		}
+
+		void finish()
+		{
+			if (finished_at == clock_type::time_point())
+				finished_at = clock_type::now();
+			if (!measuring)
+				started_at = finished_at;
+
+			// closing the sockets fails their reads, and the io_service runs out of work
+			boost::system::error_code ignored;
+			timer.cancel(ignored);
+			if (probe_timer)
+				probe_timer->cancel(ignored);
+			publisher.close(ignored);
+			for (auto &s: subscribers)
+				s->socket.close(ignored);
+		}
+
+		boost::asio::io_service							&io_service;
+		const options									&opts;
+		std::string										topic;
+		tcp::endpoint									endpoint;
+		tcp::socket										publisher;
+		boost::asio::steady_timer						timer;
+		std::unique_ptr<boost::asio::steady_timer>		probe_timer;
+		std::vector<boost::shared_ptr<subscriber> >		subscribers;
+		size_t											subscriber_count;
+		size_t											connected;
+		size_t											ready;
+		size_t											sent;
+		size_t											completed;
+		std::string										queued;
+		std::string										in_flight;
+		bool											writing;
+		bool											measuring;
+		std::vector<size_t>								received_by;
+		std::vector<clock_type::time_point>				sent_at;
+		clock_type::time_point							started_at;
+		clock_type::time_point							finished_at;
+		latency_histogram								fan_out;
+		latency_histogram								delivery;
+};
+
+void subscriber::received(const boost::system::error_code &error, size_t bytes)
+{
+	if (error)
+		return;
+
+	const char *data = buffer;
+	const char *end = buffer + bytes;
+	while (data < end)
+	{
+		const char *terminator = static_cast<const char*>(std::memchr(data, '\0', end - data));
+		if (!terminator)
+		{
+			partial.append(data, end);
+			break;
+		}
+
+		if (partial.empty())
+			round.delivered(data, terminator - data, probed);
+		else
+		{
+			partial.append(data, terminator);
+			round.delivered(partial.data(), partial.size(), probed);
+			partial.clear();
+		}
+		data = terminator + 1;
+	}
+
+	read();
+}
+
+bool parse_options(int argc, char* argv[], options &opts)
+{
+	std::map<std::string, std::string> values;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string key = argv[i];
+		if (key.compare(0, 2, "--") != 0)
+			return false;
+		values[key.substr(2)] = argv[i + 1];
+	}
+	if (argc % 2 == 0)
+		return false;
+
+	for (std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it)
+	{
+		const std::string &key = it->first;
+		const char *value = it->second.c_str();
+
+		if (key == "host")				opts.host = value;
+		else if (key == "port")			opts.port = static_cast<unsigned short>(std::strtoul(value, nullptr, 10));
+		else if (key == "subscribers")	opts.subscribers = value;
+		else if (key == "messages")		opts.messages = std::strtoul(value, nullptr, 10);
+		else if (key == "size")			opts.size = std::strtoul(value, nullptr, 10);
+		else if (key == "window")		opts.window = std::strtoul(value, nullptr, 10);
+		else if (key == "timeout")		opts.timeout = std::strtod(value, nullptr);
+		else
+			return false;
+	}
+
+	return opts.messages > 0 && opts.window > 0 && opts.timeout > 0;
+}
+
+int main(int argc, char* argv[])
+{
+	options opts;
+	if (!parse_options(argc, argv, opts))
+	{
+		std::fprintf(stderr, "usage: pubsub_benchmark [--host h] [--port p] [--subscribers n,n,...] "
+							 "[--messages n] [--size n] [--window n] [--timeout s]\n");
+		return 1;
+	}
+
+	// a descriptor per subscriber
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	std::printf("subscribers,messages,size,window,completed,seconds,deliveries_per_sec,"
+				"fan_out_p50_us,fan_out_p99_us,fan_out_max_us,delivery_p50_us,delivery_p99_us,complete\n");
+
+	boost::asio::io_service io_service;
+	const char *counts = opts.subscribers.c_str();
+	for (size_t number = 0; *counts; number++)
+	{
+		char *next;
+		size_t subscribers = std::strtoul(counts, &next, 10);
+		if (next == counts)
+			break;
+		counts = *next == ',' ? next + 1 : next;
+
+		if (subscribers == 0)
+			continue;
+
+		try
+		{
+			fan_out_round round(io_service, opts, subscribers, number);
+			bool complete = round.run();
+			round.print(complete);
+			std::fflush(stdout);
+		}
+		catch (std::exception &e)
+		{
+			std::fprintf(stderr, "%zu subscribers: %s\n", subscribers, e.what());
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef SLAB_REGISTRY_HPP
+#define SLAB_REGISTRY_HPP
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+#include <vector>
+
+// Generation-indexed slab of values.
+//
+// insert() and remove() are O(1): a removed slot goes on a free list and is
+// reused by the next insert, with its generation bumped so handles to the old
+// value stop resolving. Live values are kept packed in one vector (removal
+// swaps the last value into the hole), so iterating visits live values only.
+// Memory is bounded by the peak number of live values, not by the number of
+// values ever inserted.
+//
+// Not thread safe: each registry belongs to the thread that owns its values.
+template <typename T>
+class SlabRegistry
+{
+	public:
+		struct Handle
+		{
+			boost::uint32_t	index;
+			boost::uint32_t	generation;
+		};
+
+		typedef typename std::vector<T>::iterator				iterator;
+		typedef typename std::vector<T>::const_iterator	const_iterator;
+
+		SlabRegistry() : m_freeHead(NONE)
+		{}
+
+		Handle insert(const T& value)
+		{
+			boost::uint32_t index;
+			if (m_freeHead != NONE)
+			{
+				index = m_freeHead;
+				m_freeHead = m_slots[index].nextFree;
+			}
+			else
+			{
+				index = static_cast<boost::uint32_t>(m_slots.size());
+				m_slots.push_back(Slot());
+			}
+
+			Slot& slot = m_slots[index];
+			slot.dense = static_cast<boost::uint32_t>(m_values.size());
+			slot.nextFree = NONE;
+			m_values.push_back(value);
+			m_owners.push_back(index);
+
+			Handle handle = { index, slot.generation };
+			return handle;
+		}
+
+		// false if the handle is stale, i.e. its value was removed already
+		bool remove(Handle handle)
+		{
+			if (!valid(handle))
+				return false;
+
+			Slot& slot = m_slots[handle.index];
+			boost::uint32_t last = static_cast<boost::uint32_t>(m_values.size() - 1);
+
+			if (slot.dense != last)
+			{
+				m_values[slot.dense] = m_values[last];
+				m_owners[slot.dense] = m_owners[last];
+				m_slots[m_owners[slot.dense]].dense = slot.dense;
+			}
+			m_values.pop_back();
+			m_owners.pop_back();
+
+			slot.generation++;
+			slot.dense = NONE;
+			slot.nextFree = m_freeHead;
+			m_freeHead = handle.index;
+			return true;
+		}
+
+		// null if the handle is stale
+		T* find(Handle handle)
+		{
+			return valid(handle) ? &m_values[m_slots[handle.index].dense] : nullptr;
+		}
+
+		std::size_t size() const
+		{
+			return m_values.size();
+		}
+
+		iterator begin() { return m_values.begin(); }
+		iterator end() { return m_values.end(); }
+		const_iterator begin() const { return m_values.begin(); }
+		const_iterator end() const { return m_values.end(); }
+
+	protected:
+		static const boost::uint32_t NONE = 0xffffffff;
+
+		struct Slot
+		{
+			Slot() : generation(0), dense(NONE), nextFree(NONE) {}
+
+			boost::uint32_t	generation;
+			boost::uint32_t	dense;			// position in m_values, NONE when free
+			boost::uint32_t	nextFree;
+		};
+
+		bool valid(Handle handle) const
+		{
+			return handle.index < m_slots.size()
+				&& m_slots[handle.index].generation == handle.generation
+				&& m_slots[handle.index].dense != NONE;
+		}
+
+		std::vector<Slot>							m_slots;
+		std::vector<T>								m_values;		// live values, packed
+		std::vector<boost::uint32_t>	m_owners;		// slot index of each packed value
+		boost::uint32_t								m_freeHead;
+};
+
+#endif
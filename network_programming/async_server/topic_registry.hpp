@@ -0,0 +1,61 @@
+#ifndef TOPIC_REGISTRY_HPP
+#define TOPIC_REGISTRY_HPP
+
+#include <boost/unordered_map.hpp>
+#include <cstddef>
+#include <string>
+#include "slab_registry.hpp"
+
+// Subscribers by topic name.
+//
+// Every topic is a SlabRegistry of its subscribers: subscribing and
+// unsubscribing are O(1) once the topic is found, and a publication visits
+// the live subscribers of its topic only, packed in one vector. A topic is
+// dropped with its last subscriber.
+//
+// Not thread safe: like the connection registry, each shard keeps one for
+// the subscribers it owns.
+template <typename T>
+class TopicRegistry
+{
+	public:
+		typedef SlabRegistry<T>									Subscribers;
+		typedef typename Subscribers::Handle		Handle;
+
+		Handle subscribe(const std::string& topic, const T& subscriber)
+		{
+			return m_topics[topic].insert(subscriber);
+		}
+
+		// false if "handle" is stale or names no subscriber of "topic"
+		bool unsubscribe(const std::string& topic, Handle handle)
+		{
+			typename TopicMap::iterator it = m_topics.find(topic);
+			if (it == m_topics.end() || !it->second.remove(handle))
+				return false;
+
+			if (it->second.size() == 0)
+				m_topics.erase(it);
+			return true;
+		}
+
+		// the subscribers of "topic", null if it has none; do not subscribe
+		// or unsubscribe while iterating them
+		Subscribers* find(const std::string& topic)
+		{
+			typename TopicMap::iterator it = m_topics.find(topic);
+			return it == m_topics.end() ? nullptr : &it->second;
+		}
+
+		std::size_t topicCount() const
+		{
+			return m_topics.size();
+		}
+
+	private:
+		typedef boost::unordered_map<std::string, Subscribers> TopicMap;
+
+		TopicMap	m_topics;
+};
+
+#endif
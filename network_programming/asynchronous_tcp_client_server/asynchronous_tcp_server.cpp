@@ -5,6 +5,8 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/asio.hpp>
+#include <boost/version.hpp>
+#include "../common/latency_recorder.hpp"
 
 using boost::asio::ip::tcp;
 
@@ -37,6 +39,7 @@ class tcp_connection : public boost::enable_shared_from_this<tcp_connection>
 			// The data to be sent is stored in the class member "m_mesage" as we 
 			// need to keep the data valid till the asynchronous operation is complete.
 			m_message = make_daytime_string();
+			m_started = latency_recorder::clock_type::now();
 			
 			// Call boost::asio::async_write() to serve data to the client.
 			// using boost::async_write() instead of boost::async_write_some() will ensure
@@ -80,11 +83,15 @@ class tcp_connection : public boost::enable_shared_from_this<tcp_connection>
 		{}
 */		
 		void handle_write()
-		{}
+		{
+			// a daytime server never reads, so only the write side is timed
+			latency_recorder::instance().record_since(handler_to_write_complete, m_started);
+		}
 		
 		// member variables
 		tcp::socket socket_;
 		std::string m_message;
+		latency_recorder::clock_type::time_point m_started;
 };
 
 class tcp_server
@@ -100,10 +107,20 @@ class tcp_server
 		}
 	private:
 		// member functions
+		// newer Boost dropped get_io_service()
+		boost::asio::io_service& acceptor_io_service()
+		{
+#if BOOST_VERSION >= 107000
+			return static_cast<boost::asio::io_service&>(acceptor_.get_executor().context());
+#else
+			return acceptor_.get_io_service();
+#endif
+		}
+		
 		void start_accept()
 		{
 			// create a socket
-			tcp_connection::pointer new_connection = tcp_connection::create(acceptor_.get_io_service());
+			tcp_connection::pointer new_connection = tcp_connection::create(acceptor_io_service());
 			
 			// initiates an asynchronous accept operation to wait for a new connection
 			acceptor_.async_accept(new_connection->socket(),
@@ -142,6 +159,9 @@ int main()
 		// that the server object will use 
 		tcp_server server(io_service);
 		
+		// print the latency histograms every 10 seconds
+		periodic_latency_dump latency_dump(io_service, std::chrono::seconds(10), std::cerr);
+		
 		// Run the I/O service object to perform an asynchronous operation.
 		io_service.run();
 	}
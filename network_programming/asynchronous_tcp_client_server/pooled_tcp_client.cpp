@@ -0,0 +1,189 @@
+// Below code is for an asynchronous TCP client that reuses its connections
+//
+// It sends "requests" one line requests to a line echo server (the threaded
+// example's server on port 11235) one after the other, each over a socket
+// leased from a connection_pool. The host is resolved once up front; after the
+// first request every lease is served from the pool, so no request pays for a
+// resolve or a connect. Pass "fresh" to connect for every request instead and
+// compare the two.
+
+#include <iostream>
+#include <array>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include "../common/connection_pool.hpp"
+
+using boost::asio::ip::tcp;
+
+const std::string REQUEST = "Hello World!!!!!!!!!\n";
+
+class pooled_client
+{
+	public:
+		pooled_client(
+				boost::asio::io_service& io_service,
+				connection_pool& pool,
+				const tcp::endpoint& endpoint,
+				unsigned long requests,
+				bool fresh
+		) :
+			io_service_(io_service),
+			pool_(pool),
+			endpoint_(endpoint),
+			remaining_(requests),
+			fresh_(fresh),
+			failed_(false)
+		{}
+
+		void start()
+		{
+			next_request();
+		}
+
+		bool failed() const
+		{
+			return failed_;
+		}
+
+	private:
+		void next_request()
+		{
+			if (remaining_ == 0)
+			{
+				pool_.close();		// its eviction timer would keep run() going
+				return;
+			}
+			remaining_--;
+
+			if (fresh_)
+			{
+				// what the other clients do: a new connection for every exchange
+				auto socket = std::make_shared<tcp::socket>(io_service_);
+				socket->async_connect(endpoint_,
+					[this, socket](const boost::system::error_code& error)
+					{
+						if (error)
+						{
+							fail(error);
+							return;
+						}
+						exchange(*socket, [socket](bool) {});
+					});
+				return;
+			}
+
+			pool_.async_lease(endpoint_,
+				[this](const boost::system::error_code& error, connection_pool::lease lease)
+				{
+					if (error)
+					{
+						fail(error);
+						return;
+					}
+
+					// the lease must stay alive until the exchange is over
+					auto held = std::make_shared<connection_pool::lease>(std::move(lease));
+					exchange(held->socket(),
+						[held](bool ok)
+						{
+							if (!ok)
+								held->discard();
+						});
+				});
+		}
+
+		// writes REQUEST and reads back the echo, which comes without the '\n'
+		template <typename Done>
+		void exchange(tcp::socket& socket, Done done)
+		{
+			boost::asio::async_write(socket, boost::asio::buffer(REQUEST),
+				[this, &socket, done](const boost::system::error_code& error, size_t)
+				{
+					if (error)
+					{
+						done(false);
+						fail(error);
+						return;
+					}
+
+					boost::asio::async_read(socket, boost::asio::buffer(reply_.data(), REQUEST.size() - 1),
+						[this, done](const boost::system::error_code& error, size_t)
+						{
+							done(!error);
+							if (error)
+							{
+								fail(error);
+								return;
+							}
+
+							// posted, so this handler and the lease it holds are gone by
+							// the time the next request asks the pool for a socket
+							io_service_.post([this]() { next_request(); });
+						});
+				});
+		}
+
+		void fail(const boost::system::error_code& error)
+		{
+			std::cerr << "request failed: " << error.message() << "\n";
+			failed_ = true;
+			io_service_.stop();
+		}
+
+		boost::asio::io_service&	io_service_;
+		connection_pool&			pool_;
+		tcp::endpoint				endpoint_;
+		unsigned long				remaining_;
+		bool						fresh_;
+		bool						failed_;
+		std::array<char, 64>		reply_;
+};
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		if (argc < 2 || argc > 4)
+		{
+			std::cerr << "Usage: pooled_tcp_client <ip-address> [requests] [pooled|fresh]\n";
+			return 1;
+		}
+
+		unsigned long requests = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000;
+		bool fresh = argc > 3 && std::string(argv[3]) == "fresh";
+
+		boost::asio::io_service io_service;
+
+		// resolved once; the pool is keyed by the resulting endpoint
+		tcp::resolver resolver(io_service);
+		tcp::resolver::query query(argv[1], "11235");
+		tcp::endpoint endpoint = *resolver.resolve(query);
+
+		connection_pool pool(io_service);
+		pooled_client client(io_service, pool, endpoint, requests, fresh);
+
+		auto started = std::chrono::steady_clock::now();
+		client.start();
+		io_service.run();
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		connection_pool::endpoint_stats stats = pool.stats(endpoint);
+
+		std::cout << requests << " requests " << (fresh ? "on fresh connections" : "through the pool")
+				  << " in " << seconds << " s, " << requests / seconds << " requests/sec\n";
+		if (!fresh)
+			std::cout << "connected " << stats.connected << ", reused " << stats.reused
+					  << ", dead on lease " << stats.dead_on_lease << "\n";
+
+		return client.failed() ? 1 : 0;
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+#!/bin/bash
+# Threading-model benchmark: runs the same load against the server designs in
+# this repository across connection and thread counts, and writes one row per
+# run to results.csv and results.json.
+#
+# usage: threading_models.sh build            compile servers and load generator
+#        threading_models.sh run [dir]        run the matrix, results into dir
+#                                             (results/threading_models-<time>)
+#        threading_models.sh all [dir]        both
+#
+# models
+#   thread_per_connection   my_server, one thread per client      (line)
+#   shared_io_service       my_async_server, "threads" threads call run() on
+#                           one io_service                         (line)
+#   single_threaded_async   async_server --echo with one shard     (line)
+#   io_service_per_thread   async_server --echo with "threads"
+#                           shards                                 (line)
+#
+# every model echoes the line protocol, so every row measures the time until
+# a request's echo is back (see load_generator's --protocol). async_server
+# splits lines at '\n' and '\r' like the others, but takes a '\0' as part of
+# the line where they drop the rest of the read; load_generator never sends
+# one. thread_per_connection and single_threaded_async do not depend on
+# "threads" and run once per connection count.
+#
+# Server columns come from /proc/<pid>/task/*/status: rss_kb and
+# peak_rss_kb at the end of the measured period, live_threads at that time,
+# and the voluntary / involuntary context switches of those threads during
+# it.
+#
+# environment, with defaults
+#   CONNECTIONS="16 128 512"  THREADS="1 2 4"  CLIENT_THREADS=2
+#   DURATION=10  WARMUP=2  SIZE=64  PIPELINE=1  RATE=0
+#   BUILD_DIR=build/threading_models  CXX=g++  CXXFLAGS="-std=c++11 -O2"
+#   LDLIBS="-lboost_thread -lboost_chrono -lboost_system -lpthread"
+
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+ROOT="$(dirname "$HERE")"
+THREADED_DIR="$ROOT/threaded_async_client_server/threaded_async_client_server---Example-1---Version-1"
+
+BUILD_DIR="${BUILD_DIR:-build/threading_models}"
+CXX="${CXX:-g++}"
+CXXFLAGS="${CXXFLAGS:--std=c++11 -O2}"
+LDLIBS="${LDLIBS:--lboost_thread -lboost_chrono -lboost_system -lpthread}"
+
+CONNECTIONS="${CONNECTIONS:-16 128 512}"
+THREADS="${THREADS:-1 2 4}"
+CLIENT_THREADS="${CLIENT_THREADS:-2}"
+DURATION="${DURATION:-10}"
+WARMUP="${WARMUP:-2}"
+SIZE="${SIZE:-64}"
+PIPELINE="${PIPELINE:-1}"
+RATE="${RATE:-0}"
+
+# both servers listen here
+PORT=11235
+
+build()
+{
+	mkdir -p "$BUILD_DIR"
+	echo "building into $BUILD_DIR"
+	$CXX $CXXFLAGS "$ROOT/load_generator/load_generator.cpp" -o "$BUILD_DIR/load_generator" $LDLIBS
+	$CXX $CXXFLAGS "$THREADED_DIR/main.cpp" -o "$BUILD_DIR/threaded_server" $LDLIBS
+	$CXX $CXXFLAGS "$ROOT/async_server/async_server.cpp" -o "$BUILD_DIR/async_server" $LDLIBS
+}
+
+# waits until something accepts on PORT
+wait_for_port()
+{
+	for i in $(seq 100); do
+		if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "nothing listens on port $PORT" >&2
+	return 1
+}
+
+# "rss_kb peak_rss_kb threads voluntary involuntary" of a process, summed over its threads
+server_stats()
+{
+	local pid=$1
+	awk '
+		FILENAME ~ /\/task\// && /^voluntary_ctxt_switches/		{ voluntary += $2 }
+		FILENAME ~ /\/task\// && /^nonvoluntary_ctxt_switches/	{ involuntary += $2 }
+		FILENAME ~ /\/task\// && /^Name/						{ threads++ }
+		FILENAME !~ /\/task\// && /^VmRSS/						{ rss = $2 }
+		FILENAME !~ /\/task\// && /^VmHWM/						{ hwm = $2 }
+		END { print rss + 0, hwm + 0, threads + 0, voluntary + 0, involuntary + 0 }
+	' "/proc/$pid/status" /proc/$pid/task/*/status 2>/dev/null
+}
+
+# run_one <model> <server threads> <connections> <protocol> <server command...>
+run_one()
+{
+	local model=$1 threads=$2 connections=$3 protocol=$4
+	shift 4
+
+	"$@" > /dev/null 2>&1 &
+	local server=$!
+	wait_for_port
+
+	"$BUILD_DIR/load_generator" --port $PORT --protocol $protocol --connections $connections \
+		--threads $CLIENT_THREADS --size $SIZE --pipeline $PIPELINE --rate $RATE \
+		--duration $DURATION --warmup $WARMUP --format csv > "$RESULTS/.client" &
+	local client=$!
+
+	# sample the server over the measured period only
+	sleep $WARMUP
+	local before=($(server_stats $server))
+	sleep $(awk "BEGIN { print ($DURATION > 1 ? $DURATION - 0.5 : $DURATION) }")
+	local after=($(server_stats $server))
+
+	wait $client || true
+	kill $server 2>/dev/null || true
+	wait $server 2>/dev/null || true
+
+	local row
+	row="$(tail -n 1 "$RESULTS/.client")"
+	if [ -z "$row" ]; then
+		echo "  $model threads=$threads connections=$connections: no result" >&2
+		return
+	fi
+
+	echo "$model,$threads,$row,${after[0]},${after[1]},${after[2]},$((after[3] - before[3])),$((after[4] - before[4]))" \
+		>> "$RESULTS/results.csv"
+	echo "  $model threads=$threads connections=$connections: $(echo "$row" | cut -d, -f10) req/s"
+}
+
+# results.csv -> results.json, an array of objects; numbers stay numbers
+to_json()
+{
+	awk -F, '
+		NR == 1 { for (i = 1; i <= NF; i++) name[i] = $i; printf "["; next }
+		{
+			printf "%s\n  {", (NR > 2 ? "," : "")
+			for (i = 1; i <= NF; i++) {
+				value = ($i ~ /^-?[0-9]+(\.[0-9]+)?$/) ? $i : "\"" $i "\""
+				printf "%s\"%s\": %s", (i > 1 ? ", " : ""), name[i], value
+			}
+			printf "}"
+		}
+		END { print "\n]" }
+	' "$1"
+}
+
+run()
+{
+	RESULTS="${1:-results/threading_models-$(date +%Y%m%d-%H%M%S)}"
+	mkdir -p "$RESULTS"
+
+	for binary in load_generator threaded_server async_server; do
+		if [ ! -x "$BUILD_DIR/$binary" ]; then
+			echo "$BUILD_DIR/$binary missing, run \"$0 build\" first" >&2
+			exit 1
+		fi
+	done
+
+	# thread per connection needs a descriptor pair per client
+	ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+
+	echo "model,server_threads,$("$BUILD_DIR/load_generator" --csv-header),rss_kb,peak_rss_kb,live_threads,voluntary_cs,involuntary_cs" \
+		> "$RESULTS/results.csv"
+
+	for connections in $CONNECTIONS; do
+		run_one thread_per_connection 1 $connections line "$BUILD_DIR/threaded_server" threaded 1
+		run_one single_threaded_async 1 $connections line "$BUILD_DIR/async_server" --echo --duration 0 1
+
+		for threads in $THREADS; do
+			run_one shared_io_service $threads $connections line "$BUILD_DIR/threaded_server" async $threads
+			run_one io_service_per_thread $threads $connections line "$BUILD_DIR/async_server" --echo --duration 0 $threads
+		done
+	done
+
+	to_json "$RESULTS/results.csv" > "$RESULTS/results.json"
+	rm -f "$RESULTS/.client"
+	echo "results in $RESULTS/results.csv and $RESULTS/results.json"
+}
+
+case "$1" in
+	build)	build ;;
+	run)	run "$2" ;;
+	all)	build; run "$2" ;;
+	*)		sed -n '2,/^$/s/^# \{0,1\}//p' "$0"; exit 1 ;;
+esac
@@ -0,0 +1,239 @@
+#ifndef ADMISSION_CONTROL_HPP
+#define ADMISSION_CONTROL_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <vector>
+
+/**
+ * limits of an admission_control; 0 means no limit
+ */
+struct admission_limits
+{
+	admission_limits() : max_connections(0), max_per_address(0), accept_rate(0), accept_burst(0) {}
+
+	size_t	max_connections;		// live connections of the server
+	size_t	max_per_address;		// live connections from one source address
+	double	accept_rate;			// connections accepted per second, on average
+	double	accept_burst;			// ... of which up to this many at once, at least 1
+};
+
+/**
+ * decides whether a server accepts its next connection, so that a connection
+ * storm cannot take the server down for the clients it already serves
+ *
+ * before each accept the server asks may_accept() whether there is room: one
+ * of max_connections and a token of the accept_rate bucket. When there is
+ * none the server stops accepting and newcomers wait in the kernel's listen
+ * backlog, not in the server; it resumes by itself, on its timer after
+ * "retry_after" when the rate was exceeded, or when the "resume" handler is
+ * called because a connection closed. may_accept() takes nothing, so accepts
+ * kept outstanding while no one connects do not hold places or tokens. A
+ * server keeping several accepts outstanding tells may_accept() how many, so
+ * it never has more of them armed than there are places and tokens left:
+ * when a burst arrives, all of them complete at once.
+ *
+ * once a connection is accepted, admit() takes its place, its token and a
+ * place of max_per_address. It refuses when one is gone, because another
+ * acceptor sharing the budget took the last one meanwhile or the address has
+ * too many connections; the refused connection is closed right away, as it
+ * already took the accept work. release() when an admitted connection closes.
+ *
+ *   admission_control::clock_type::duration retry_after;
+ *   if ( !admission.may_accept( retry_after, resume ) )
+ *       ... retry_after > 0 ? wait that long : wait for resume(), then retry
+ *   ... accept
+ *   if ( !admission.admit( peer.address() ) ) close it
+ *   ... once the connection ends: admission.release( peer.address() )
+ *
+ * may be shared by several acceptors and threads; "resume" handlers are
+ * called from the thread calling release() and should only post to the
+ * acceptor's own thread. close() drops the handlers still waiting.
+ */
+class admission_control
+{
+	public:
+		typedef std::chrono::steady_clock			clock_type;
+		typedef boost::asio::ip::address			address_type;
+		typedef std::function<void ()>				resume_handler;
+
+		/**
+		 * counters since construction
+		 */
+		struct admission_stats
+		{
+			admission_stats() :
+				admitted(0), refused_per_address(0), refused_over_budget(0), paused_at_capacity(0), paused_by_rate(0)
+			{}
+
+			boost::uint64_t admitted;
+			boost::uint64_t refused_per_address;	// accepted and closed again
+			boost::uint64_t refused_over_budget;	// accepted and closed again, no place or token left
+			boost::uint64_t paused_at_capacity;		// may_accept() refusals, max_connections
+			boost::uint64_t paused_by_rate;			// may_accept() refusals, accept_rate
+		};
+
+		explicit admission_control(const admission_limits &limits = admission_limits()) :
+			limits(limits),
+			live(0),
+			tokens(std::max(1.0, limits.accept_burst)),
+			refilled_at(clock_type::now()),
+			closed(false)
+		{}
+
+		/**
+		 * whether the server may start one more accept next to the
+		 * "outstanding" ones it started before, not admitted yet; false when
+		 * they use up its budget. "retry_after" is then how long until the
+		 * rate allows one more, or zero when the server is full and "resume"
+		 * will be called once a connection closes.
+		 */
+		bool may_accept(clock_type::duration &retry_after, const resume_handler &resume, size_t outstanding = 0)
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			retry_after = clock_type::duration::zero();
+
+			if (limits.max_connections > 0 && live + outstanding >= limits.max_connections)
+			{
+				stats_.paused_at_capacity++;
+				if (!closed)
+					waiting.push_back(resume);
+				return false;
+			}
+
+			if (limits.accept_rate > 0)
+			{
+				refill();
+				double needed = outstanding + 1.0;
+				if (tokens < needed)
+				{
+					stats_.paused_by_rate++;
+					retry_after = std::chrono::duration_cast<clock_type::duration>(
+						std::chrono::duration<double>((needed - tokens) / limits.accept_rate)) + std::chrono::milliseconds(1);
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		/**
+		 * takes a place and a token for an accepted connection from "address";
+		 * false if there is none left, or that address is at max_per_address
+		 */
+		bool admit(const address_type &address)
+		{
+			boost::mutex::scoped_lock lock(mutex);
+
+			if (limits.max_connections > 0 && live >= limits.max_connections)
+			{
+				stats_.refused_over_budget++;
+				return false;
+			}
+
+			if (limits.accept_rate > 0)
+			{
+				refill();
+				if (tokens < 1.0)
+				{
+					stats_.refused_over_budget++;
+					return false;
+				}
+			}
+
+			size_t &from_address = per_address[address];
+			if (limits.max_per_address > 0 && from_address >= limits.max_per_address)
+			{
+				stats_.refused_per_address++;
+				return false;
+			}
+
+			if (limits.accept_rate > 0)
+				tokens -= 1.0;
+			from_address++;
+			live++;
+			stats_.admitted++;
+			return true;
+		}
+
+		/**
+		 * an admitted connection from "address" has closed
+		 */
+		void release(const address_type &address)
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			std::map<address_type, size_t>::iterator it = per_address.find(address);
+			if (it != per_address.end() && --it->second == 0)
+				per_address.erase(it);
+
+			live--;
+			wake_up();
+		}
+
+		/**
+		 * no resume handler is called after this returns
+		 */
+		void close()
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			closed = true;
+			waiting.clear();
+		}
+
+		size_t live_connections()
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			return live;
+		}
+
+		admission_stats stats()
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			return stats_;
+		}
+
+	private:
+		admission_control(const admission_control&);
+		admission_control& operator=(const admission_control&);
+
+		/**
+		 * adds the tokens earned since the last refill, up to the burst
+		 */
+		void refill()
+		{
+			clock_type::time_point now = clock_type::now();
+			double earned = std::chrono::duration<double>(now - refilled_at).count() * limits.accept_rate;
+			tokens = std::min(std::max(1.0, limits.accept_burst), tokens + earned);
+			refilled_at = now;
+		}
+
+		/**
+		 * a place has become free: every paused acceptor tries again. Called
+		 * with the lock held, which close() relies on.
+		 */
+		void wake_up()
+		{
+			std::vector<resume_handler> resume;
+			resume.swap(waiting);
+			for (auto &handler: resume)
+				handler();
+		}
+
+		admission_limits					limits;
+		boost::mutex						mutex;
+		size_t								live;
+		std::map<address_type, size_t>		per_address;
+		double								tokens;
+		clock_type::time_point				refilled_at;
+		std::vector<resume_handler>			waiting;		// acceptors paused at capacity
+		bool								closed;
+		admission_stats						stats_;
+};
+
+#endif
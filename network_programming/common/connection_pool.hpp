@@ -0,0 +1,388 @@
+#ifndef CONNECTION_POOL_HPP
+#define CONNECTION_POOL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <sys/socket.h>
+
+/**
+ * client side pool of connected sockets, keyed by endpoint
+ *
+ * a lease hands out a warm socket when one is idle for the endpoint, in O(1)
+ * and without resolving or connecting; otherwise it connects a new one. When
+ * the lease goes away its socket goes back to the pool, unless it was
+ * discard()ed or the endpoint already has max_idle sockets waiting.
+ *
+ * idle sockets are kept newest last: leases take the newest (warmest) one,
+ * the eviction timer closes those idle for longer than idle_timeout from the
+ * old end. An idle socket is health checked before it is leased out, so a
+ * connection the peer closed meanwhile is dropped instead of handed out.
+ *
+ * the eviction timer only runs while some socket is idle, and close() ends
+ * it for good, so the io_service's run() returns once the pool's user is done.
+ *
+ * the pool may be used from several threads; it must outlive its leases.
+ */
+class connection_pool
+{
+	public:
+		typedef boost::asio::ip::tcp::endpoint			endpoint_type;
+		typedef boost::asio::ip::tcp::socket			socket_type;
+		typedef boost::shared_ptr<socket_type>			socket_ptr;
+
+		/**
+		 * per endpoint counters
+		 */
+		struct endpoint_stats
+		{
+			endpoint_stats() : reused(0), connected(0), connect_failures(0), dead_on_lease(0), evicted(0) {}
+
+			boost::uint64_t reused;				// leases served from the idle list
+			boost::uint64_t connected;			// leases that needed a new connection
+			boost::uint64_t connect_failures;
+			boost::uint64_t dead_on_lease;		// idle sockets the peer had closed
+			boost::uint64_t evicted;			// idle sockets closed by the timer
+		};
+
+		/**
+		 * a socket on loan from the pool, given back on destruction
+		 */
+		class lease
+		{
+			public:
+				lease() : pool(nullptr) {}
+
+				lease(connection_pool *pool, const endpoint_type &endpoint, socket_ptr socket) :
+					pool(pool),
+					endpoint(endpoint),
+					socket_(socket)
+				{}
+
+				lease(lease &&other) :
+					pool(other.pool),
+					endpoint(other.endpoint),
+					socket_(other.socket_)
+				{
+					other.socket_.reset();
+				}
+
+				lease& operator=(lease &&other)
+				{
+					if (this != &other)
+					{
+						give_back();
+						pool = other.pool;
+						endpoint = other.endpoint;
+						socket_ = other.socket_;
+						other.socket_.reset();
+					}
+					return *this;
+				}
+
+				~lease()
+				{
+					give_back();
+				}
+
+				socket_type& socket() { return *socket_; }
+
+				explicit operator bool() const { return socket_ != nullptr; }
+
+				/**
+				 * the socket is in an unknown state (error, half read reply...),
+				 * close it instead of returning it to the pool
+				 */
+				void discard()
+				{
+					if (socket_)
+					{
+						boost::system::error_code ignored;
+						socket_->close(ignored);
+						socket_.reset();
+					}
+				}
+
+			private:
+				lease(const lease&);
+				lease& operator=(const lease&);
+
+				void give_back()
+				{
+					if (socket_ && pool)
+						pool->release(endpoint, socket_);
+					socket_.reset();
+				}
+
+				connection_pool		*pool;
+				endpoint_type		endpoint;
+				socket_ptr			socket_;
+		};
+
+		connection_pool(
+				boost::asio::io_service &io_service,
+				size_t max_idle = 8,
+				std::chrono::seconds idle_timeout = std::chrono::seconds(30)
+		) :
+			io_service(io_service),
+			max_idle(max_idle),
+			idle_timeout(idle_timeout),
+			eviction_timer(io_service),
+			eviction_scheduled(false),
+			closed(false)
+		{}
+
+		~connection_pool()
+		{
+			close();
+		}
+
+		/**
+		 * closes the idle sockets and stops the eviction timer; sockets given
+		 * back afterwards are closed instead of kept
+		 */
+		void close()
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			closed = true;
+			for (auto &item: endpoints)
+			{
+				for (auto &idle: item.second.idle)
+				{
+					boost::system::error_code ignored;
+					idle.socket->close(ignored);
+				}
+				item.second.idle.clear();
+			}
+
+			boost::system::error_code ignored;
+			eviction_timer.cancel(ignored);
+			eviction_scheduled = false;
+		}
+
+		/**
+		 * a healthy idle socket for "endpoint", or an empty lease when there
+		 * is none; never blocks
+		 */
+		lease try_lease(const endpoint_type &endpoint)
+		{
+			socket_ptr socket = take_idle(endpoint);
+			return socket ? lease(this, endpoint, socket) : lease();
+		}
+
+		/**
+		 * calls handler(const boost::system::error_code&, lease) with a warm
+		 * socket if there is one, otherwise once a new connection is made.
+		 * The handler always runs from the io_service, never from inside
+		 * async_lease().
+		 */
+		template <typename Handler>
+		void async_lease(const endpoint_type &endpoint, Handler handler)
+		{
+			socket_ptr warm = take_idle(endpoint);
+			if (warm)
+			{
+				io_service.post(
+					[this, endpoint, warm, handler]() mutable
+					{
+						handler(boost::system::error_code(), lease(this, endpoint, warm));
+					}
+				);
+				return;
+			}
+
+			socket_ptr socket(new socket_type(io_service));
+			socket->async_connect(
+				endpoint,
+				[this, endpoint, socket, handler](const boost::system::error_code &error) mutable
+				{
+					{
+						boost::mutex::scoped_lock lock(mutex);
+						endpoint_stats &stats = endpoints[endpoint].stats;
+						if (error)
+							stats.connect_failures++;
+						else
+							stats.connected++;
+					}
+
+					if (error)
+					{
+						handler(error, lease());
+						return;
+					}
+
+					boost::system::error_code ignored;
+					socket->set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+					handler(error, lease(this, endpoint, socket));
+				}
+			);
+		}
+
+		/**
+		 * idle sockets currently held for "endpoint"
+		 */
+		size_t idle_count(const endpoint_type &endpoint) const
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			auto it = endpoints.find(endpoint);
+			return it == endpoints.end() ? 0 : it->second.idle.size();
+		}
+
+		endpoint_stats stats(const endpoint_type &endpoint) const
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			auto it = endpoints.find(endpoint);
+			return it == endpoints.end() ? endpoint_stats() : it->second.stats;
+		}
+
+	private:
+		connection_pool(const connection_pool&);
+		connection_pool& operator=(const connection_pool&);
+
+		struct idle_socket
+		{
+			socket_ptr								socket;
+			std::chrono::steady_clock::time_point	since;
+		};
+
+		struct endpoint_entry
+		{
+			std::deque<idle_socket>		idle;		// oldest first
+			endpoint_stats				stats;
+		};
+
+		struct endpoint_hash
+		{
+			size_t operator()(const endpoint_type &endpoint) const
+			{
+				size_t seed = endpoint.port();
+				if (endpoint.address().is_v4())
+					boost::hash_combine(seed, endpoint.address().to_v4().to_ulong());
+				else
+				{
+					boost::asio::ip::address_v6::bytes_type bytes = endpoint.address().to_v6().to_bytes();
+					boost::hash_range(seed, bytes.begin(), bytes.end());
+				}
+				return seed;
+			}
+		};
+
+		/**
+		 * newest healthy idle socket for "endpoint", null if there is none
+		 */
+		socket_ptr take_idle(const endpoint_type &endpoint)
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			endpoint_entry &entry = endpoints[endpoint];
+
+			while (!entry.idle.empty())
+			{
+				socket_ptr socket = entry.idle.back().socket;
+				entry.idle.pop_back();
+
+				if (is_healthy(*socket))
+				{
+					entry.stats.reused++;
+					return socket;
+				}
+
+				entry.stats.dead_on_lease++;
+				boost::system::error_code ignored;
+				socket->close(ignored);
+			}
+			return socket_ptr();
+		}
+
+		/**
+		 * an idle socket must have nothing to read: EOF means the peer closed
+		 * it, pending bytes mean an earlier reply was not consumed
+		 */
+		static bool is_healthy(socket_type &socket)
+		{
+			char byte;
+			ssize_t result = ::recv(socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+			return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+
+		void release(const endpoint_type &endpoint, socket_ptr socket)
+		{
+			if (socket->is_open())
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				endpoint_entry &entry = endpoints[endpoint];
+				if (!closed && entry.idle.size() < max_idle)
+				{
+					idle_socket idle = { socket, std::chrono::steady_clock::now() };
+					entry.idle.push_back(idle);
+					if (!eviction_scheduled)
+						schedule_eviction();
+					return;
+				}
+			}
+
+			boost::system::error_code ignored;
+			socket->close(ignored);
+		}
+
+		/**
+		 * called with the lock held
+		 */
+		void schedule_eviction()
+		{
+			eviction_scheduled = true;
+			eviction_timer.expires_from_now(idle_timeout / 2);
+			eviction_timer.async_wait(
+				boost::bind(&connection_pool::handle_eviction, this, boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_eviction(const boost::system::error_code &error)
+		{
+			if (error)
+				return;
+
+			std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - idle_timeout;
+
+			boost::mutex::scoped_lock lock(mutex);
+			if (closed)
+				return;
+
+			eviction_scheduled = false;
+			bool any_idle = false;
+			for (auto &item: endpoints)
+			{
+				endpoint_entry &entry = item.second;
+				while (!entry.idle.empty() && entry.idle.front().since < cutoff)
+				{
+					boost::system::error_code ignored;
+					entry.idle.front().socket->close(ignored);
+					entry.idle.pop_front();
+					entry.stats.evicted++;
+				}
+				any_idle = any_idle || !entry.idle.empty();
+			}
+
+			// with nothing idle the timer stops, release() starts it again
+			if (any_idle)
+				schedule_eviction();
+		}
+
+		boost::asio::io_service									&io_service;
+		size_t													max_idle;
+		std::chrono::seconds									idle_timeout;
+		boost::asio::steady_timer								eviction_timer;
+		bool													eviction_scheduled;		// the timer is armed
+		bool													closed;
+		mutable boost::mutex									mutex;
+		std::unordered_map<endpoint_type, endpoint_entry, endpoint_hash>	endpoints;
+};
+
+#endif
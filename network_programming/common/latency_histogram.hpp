@@ -0,0 +1,133 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <boost/cstdint.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/**
+ * HDR-style log-linear histogram of non-negative integer values (we record
+ * nanoseconds).
+ *
+ * values below 128 get a bucket each; above that every power of two is split
+ * into 64 linear buckets, so any recorded value is reported within 1/64
+ * (~1.6%) of its true value over the full 64 bit range, in 32KB of counters.
+ * record() is a shift, a count-leading-zeros and an increment.
+ */
+class latency_histogram
+{
+	public:
+		static const unsigned int SUB_BITS = 6;
+		static const size_t SUB_COUNT = size_t(1) << SUB_BITS;				// 64
+		static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT + SUB_COUNT;
+
+		latency_histogram() :
+			counts(BUCKETS),
+			total(0),
+			sum(0),
+			min_value(~boost::uint64_t(0)),
+			max_value(0)
+		{}
+
+		static size_t bucket_of(boost::uint64_t value)
+		{
+			if (value < 2 * SUB_COUNT)
+				return static_cast<size_t>(value);
+
+			unsigned int exponent = 63 - __builtin_clzll(value) - SUB_BITS;		// >= 1
+			return exponent * SUB_COUNT + static_cast<size_t>(value >> exponent);
+		}
+
+		/**
+		 * highest value that lands in "bucket"
+		 */
+		static boost::uint64_t highest_in(size_t bucket)
+		{
+			if (bucket < 2 * SUB_COUNT)
+				return bucket;
+
+			unsigned int exponent = static_cast<unsigned int>(bucket / SUB_COUNT) - 1;
+			boost::uint64_t mantissa = bucket % SUB_COUNT + SUB_COUNT;
+			return ((mantissa + 1) << exponent) - 1;
+		}
+
+		void record(boost::uint64_t value, boost::uint64_t times = 1)
+		{
+			counts[bucket_of(value)] += times;
+			total += times;
+			sum += value * times;
+			min_value = std::min(min_value, value);
+			max_value = std::max(max_value, value);
+		}
+
+		/**
+		 * adds "times" values known only by the bucket they fell in; sum, min
+		 * and max are left alone, the caller supplies them with add_summary()
+		 */
+		void add_bucket(size_t bucket, boost::uint64_t times)
+		{
+			counts[bucket] += times;
+			total += times;
+		}
+
+		void add_summary(boost::uint64_t value_sum, boost::uint64_t min, boost::uint64_t max)
+		{
+			sum += value_sum;
+			min_value = std::min(min_value, min);
+			max_value = std::max(max_value, max);
+		}
+
+		void merge(const latency_histogram &other)
+		{
+			for (size_t i = 0; i < BUCKETS; i++)
+				counts[i] += other.counts[i];
+			total += other.total;
+			sum += other.sum;
+			min_value = std::min(min_value, other.min_value);
+			max_value = std::max(max_value, other.max_value);
+		}
+
+		void reset()
+		{
+			std::fill(counts.begin(), counts.end(), 0);
+			total = sum = max_value = 0;
+			min_value = ~boost::uint64_t(0);
+		}
+
+		/**
+		 * value at or below which "percent" of the recorded values lie,
+		 * e.g. percentile(99.9); 0 when empty
+		 */
+		boost::uint64_t percentile(double percent) const
+		{
+			if (total == 0)
+				return 0;
+
+			boost::uint64_t rank = static_cast<boost::uint64_t>(percent / 100.0 * total + 0.5);
+			rank = std::max<boost::uint64_t>(1, std::min(rank, total));
+
+			boost::uint64_t seen = 0;
+			for (size_t i = 0; i < BUCKETS; i++)
+			{
+				seen += counts[i];
+				if (seen >= rank)
+					return std::min(highest_in(i), max_value);
+			}
+			return max_value;
+		}
+
+		boost::uint64_t count() const { return total; }
+		boost::uint64_t min() const { return total ? min_value : 0; }
+		boost::uint64_t max() const { return max_value; }
+		double mean() const { return total ? double(sum) / total : 0.0; }
+
+	private:
+		std::vector<boost::uint64_t>	counts;
+		boost::uint64_t					total;
+		boost::uint64_t					sum;
+		boost::uint64_t					min_value;
+		boost::uint64_t					max_value;
+};
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef LATENCY_RECORDER_HPP
+#define LATENCY_RECORDER_HPP
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+#include "latency_histogram.hpp"
+
+/**
+ * latency_histogram with a single writer and any number of readers
+ *
+ * the owning thread records with plain relaxed loads and stores, no lock and
+ * no read-modify-write; other threads may copy the counters out at any time.
+ * Counters are allocated per power of two on first use, so a histogram that
+ * only ever sees microseconds to milliseconds costs a few KB, not 30. The
+ * exact sum, min and max are kept next to them, the same way.
+ */
+class concurrent_histogram
+{
+	public:
+		concurrent_histogram() :
+			sum(0),
+			min_value(~boost::uint64_t(0)),
+			max_value(0)
+		{
+			for (size_t i = 0; i < CHUNKS; i++)
+				chunks[i].store(nullptr, std::memory_order_relaxed);
+		}
+
+		~concurrent_histogram()
+		{
+			for (size_t i = 0; i < CHUNKS; i++)
+				delete[] chunks[i].load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * owning thread only
+		 */
+		void record(boost::uint64_t value)
+		{
+			size_t bucket = latency_histogram::bucket_of(value);
+			std::atomic<boost::uint64_t> &counter = chunk(bucket / CHUNK_SIZE)[bucket % CHUNK_SIZE];
+			counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+			sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+			if (value < min_value.load(std::memory_order_relaxed))
+				min_value.store(value, std::memory_order_relaxed);
+			if (value > max_value.load(std::memory_order_relaxed))
+				max_value.store(value, std::memory_order_relaxed);
+		}
+
+		/**
+		 * owning thread only; allocates the counters of every value now, so
+		 * record() never allocates afterwards
+		 */
+		void reserve()
+		{
+			for (size_t i = 0; i < CHUNKS; i++)
+				chunk(i);
+		}
+
+		/**
+		 * any thread; percentiles come from the buckets, sum, min and max are exact
+		 */
+		void add_to(latency_histogram &histogram) const
+		{
+			for (size_t i = 0; i < CHUNKS; i++)
+			{
+				const std::atomic<boost::uint64_t> *chunk = chunks[i].load(std::memory_order_acquire);
+				if (!chunk)
+					continue;
+
+				for (size_t j = 0; j < CHUNK_SIZE; j++)
+				{
+					boost::uint64_t count = chunk[j].load(std::memory_order_relaxed);
+					if (count)
+						histogram.add_bucket(i * CHUNK_SIZE + j, count);
+				}
+			}
+
+			histogram.add_summary(
+				sum.load(std::memory_order_relaxed),
+				min_value.load(std::memory_order_relaxed),
+				max_value.load(std::memory_order_relaxed)
+			);
+		}
+
+	private:
+		concurrent_histogram(const concurrent_histogram&);
+		concurrent_histogram& operator=(const concurrent_histogram&);
+
+		static const size_t CHUNK_SIZE = latency_histogram::SUB_COUNT;
+		static const size_t CHUNKS = latency_histogram::BUCKETS / CHUNK_SIZE;
+
+		std::atomic<boost::uint64_t>* chunk(size_t index)
+		{
+			std::atomic<boost::uint64_t> *counters = chunks[index].load(std::memory_order_relaxed);
+
+			if (!counters)
+			{
+				counters = new std::atomic<boost::uint64_t>[CHUNK_SIZE]();
+				chunks[index].store(counters, std::memory_order_release);
+			}
+			return counters;
+		}
+
+		std::atomic<std::atomic<boost::uint64_t>*>	chunks[CHUNKS];
+		std::atomic<boost::uint64_t>				sum;
+		std::atomic<boost::uint64_t>				min_value;
+		std::atomic<boost::uint64_t>				max_value;
+};
+
+/**
+ * the latencies a server records about itself, in nanoseconds
+ */
+enum server_latency
+{
+	accept_to_first_byte,			// connection accepted -> first bytes read
+	read_to_handler,				// bytes read -> message/line handler runs
+	handler_to_write_complete,		// reply queued by the handler -> reply written
+	server_latency_count
+};
+
+inline const char* server_latency_name(server_latency metric)
+{
+	static const char* names[server_latency_count] = {
+		"accept_to_first_byte", "read_to_handler", "handler_to_write_complete"
+	};
+	return names[metric];
+}
+
+/**
+ * merged view of all threads at one point in time
+ */
+struct latency_snapshot
+{
+	latency_histogram metrics[server_latency_count];
+
+	void print(std::ostream &out) const
+	{
+		char line[256];
+		for (size_t i = 0; i < server_latency_count; i++)
+		{
+			const latency_histogram &h = metrics[i];
+			std::snprintf(line, sizeof(line),
+				"%-26s n=%-10llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+				server_latency_name(server_latency(i)), (unsigned long long)h.count(),
+				h.percentile(50) / 1e3, h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3);
+			out << line;
+		}
+	}
+};
+
+/**
+ * process-wide recorder of server latencies
+ *
+ * every thread records into histograms of its own, so record() takes no lock
+ * and shares no cache line with other threads. snapshot() merges all threads
+ * on demand. A thread's histograms are folded into "retired" when it exits,
+ * which keeps thread-per-connection servers from piling them up.
+ */
+class latency_recorder
+{
+	public:
+		typedef std::chrono::steady_clock clock_type;
+
+		/**
+		 * never destroyed, so threads exiting late can still retire into it
+		 */
+		static latency_recorder& instance()
+		{
+			static latency_recorder *recorder = new latency_recorder;
+			return *recorder;
+		}
+
+		void record(server_latency metric, clock_type::duration elapsed)
+		{
+			boost::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+			local().histograms[metric].record(ns > 0 ? static_cast<boost::uint64_t>(ns) : 0);
+		}
+
+		/**
+		 * records the time since "since"
+		 */
+		void record_since(server_latency metric, clock_type::time_point since)
+		{
+			record(metric, clock_type::now() - since);
+		}
+
+		/**
+		 * allocates the calling thread's histograms in full, for threads that
+		 * must not allocate once they serve
+		 */
+		void reserve()
+		{
+			for (size_t i = 0; i < server_latency_count; i++)
+				local().histograms[i].reserve();
+		}
+
+		latency_snapshot snapshot() const
+		{
+			latency_snapshot merged;
+
+			boost::mutex::scoped_lock lock(mutex);
+			for (size_t i = 0; i < server_latency_count; i++)
+				merged.metrics[i].merge(retired[i]);
+			for (size_t t = 0; t < live.size(); t++)
+				for (size_t i = 0; i < server_latency_count; i++)
+					live[t]->histograms[i].add_to(merged.metrics[i]);
+
+			return merged;
+		}
+
+	private:
+		struct thread_slot
+		{
+			concurrent_histogram histograms[server_latency_count];
+		};
+
+		struct slot_owner
+		{
+			slot_owner() : slot(nullptr) {}
+
+			~slot_owner()
+			{
+				if (slot)
+					latency_recorder::instance().retire(slot);
+			}
+
+			thread_slot *slot;
+		};
+
+		latency_recorder() {}
+
+		thread_slot& local()
+		{
+			static thread_local slot_owner owner;
+
+			if (!owner.slot)
+			{
+				owner.slot = new thread_slot;
+				boost::mutex::scoped_lock lock(mutex);
+				live.push_back(owner.slot);
+			}
+			return *owner.slot;
+		}
+
+		void retire(thread_slot *slot)
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			for (size_t i = 0; i < server_latency_count; i++)
+				slot->histograms[i].add_to(retired[i]);
+			live.erase(std::find(live.begin(), live.end(), slot));
+			lock.unlock();
+
+			delete slot;
+		}
+
+		mutable boost::mutex		mutex;
+		std::vector<thread_slot*>	live;
+		latency_histogram			retired[server_latency_count];
+};
+
+/**
+ * prints latency_recorder's snapshot every "interval" from an io_service thread
+ */
+class periodic_latency_dump
+{
+	public:
+		periodic_latency_dump(
+				boost::asio::io_service &io_service,
+				std::chrono::seconds interval,
+				std::ostream &out
+		) :
+			timer(io_service),
+			interval(interval),
+			out(out)
+		{
+			schedule();
+		}
+
+		void stop()
+		{
+			boost::system::error_code ignored;
+			timer.cancel(ignored);
+		}
+
+	private:
+		void schedule()
+		{
+			timer.expires_from_now(interval);
+			timer.async_wait(
+				boost::bind(&periodic_latency_dump::handle_timer, this, boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_timer(const boost::system::error_code &error)
+		{
+			if (error)
+				return;
+
+			latency_recorder::instance().snapshot().print(out);
+			schedule();
+		}
+
+		boost::asio::steady_timer	timer;
+		std::chrono::seconds		interval;
+		std::ostream				&out;
+};
+
+#endif
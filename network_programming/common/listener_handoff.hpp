@@ -0,0 +1,314 @@
+#ifndef LISTENER_HANDOFF_HPP
+#define LISTENER_HANDOFF_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * hot restart: a running server hands its listening sockets to the build
+ * replacing it, over a unix stream socket with SCM_RIGHTS
+ *
+ *  old process                          new process
+ *  listener_handoff_server(path)
+ *                                       listener_handoff_client(path)
+ *      <--------------- connect -------
+ *      --- count + descriptors ------->
+ *                                       acceptor.assign() each, start accepting
+ *      <----------- 1 byte ack --------  acknowledge()
+ *  stop accepting, drain connections    listener_handoff_server(path) for the
+ *  and exit                             next restart
+ *
+ * the listening sockets are never closed, so their SYN and accept backlogs
+ * survive the restart: connections queued during it are accepted by the new
+ * process. Until the ack both processes accept, which is harmless.
+ */
+
+/**
+ * most descriptors one handoff carries
+ */
+const size_t MAX_HANDOFF_DESCRIPTORS = 64;
+
+/**
+ * sends "fds" over the connected unix socket "socket" in one message
+ */
+inline void send_descriptors(int socket, const std::vector<int> &fds, boost::system::error_code &error)
+{
+	boost::uint32_t count = static_cast<boost::uint32_t>(fds.size());
+	struct iovec payload = { &count, sizeof(count) };
+
+	char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_DESCRIPTORS)];
+	std::memset(control, 0, sizeof(control));
+
+	struct msghdr message;
+	std::memset(&message, 0, sizeof(message));
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
+
+	if (count > MAX_HANDOFF_DESCRIPTORS)
+	{
+		error = boost::asio::error::invalid_argument;
+		return;
+	}
+
+	if (count > 0)
+	{
+		message.msg_control = control;
+		message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+		struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * count);
+	}
+
+	ssize_t sent;
+	do
+		sent = ::sendmsg(socket, &message, 0);
+	while (sent < 0 && errno == EINTR);
+
+	error = sent < 0
+		? boost::system::error_code(errno, boost::asio::error::get_system_category())
+		: boost::system::error_code();
+}
+
+/**
+ * receives what send_descriptors() sent; the descriptors are ours to close
+ */
+inline std::vector<int> receive_descriptors(int socket, boost::system::error_code &error)
+{
+	boost::uint32_t count = 0;
+	struct iovec payload = { &count, sizeof(count) };
+
+	char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_DESCRIPTORS)];
+
+	struct msghdr message;
+	std::memset(&message, 0, sizeof(message));
+	message.msg_iov = &payload;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	do
+		received = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+	while (received < 0 && errno == EINTR);
+
+	std::vector<int> fds;
+	if (received < 0)
+	{
+		error = boost::system::error_code(errno, boost::asio::error::get_system_category());
+		return fds;
+	}
+	if (received != sizeof(count))
+	{
+		error = boost::asio::error::eof;
+		return fds;
+	}
+
+	for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const unsigned char *data = CMSG_DATA(header);
+		for (size_t i = 0; i < n; i++)
+		{
+			int fd;
+			std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+			fds.push_back(fd);
+		}
+	}
+
+	// a truncated control message would have lost descriptors
+	if ((message.msg_flags & MSG_CTRUNC) || fds.size() != count)
+	{
+		for (size_t i = 0; i < fds.size(); i++)
+			::close(fds[i]);
+		fds.clear();
+		error = boost::asio::error::message_size;
+		return fds;
+	}
+
+	error = boost::system::error_code();
+	return fds;
+}
+
+/**
+ * old process side: serves its listening descriptors on "path" until a new
+ * process has taken them, then calls on_handed_off() (from the io_service)
+ * and stops serving. The caller then stops accepting and drains.
+ *
+ * a stale socket file at "path" is replaced.
+ */
+class listener_handoff_server
+{
+	public:
+		listener_handoff_server(
+				boost::asio::io_service &io_service,
+				const std::string &path,
+				const std::vector<int> &fds,
+				boost::function<void ()> on_handed_off
+		) :
+			acceptor(io_service),
+			peer(io_service),
+			fds(fds),
+			on_handed_off(on_handed_off)
+		{
+			::unlink(path.c_str());
+
+			boost::asio::local::stream_protocol::endpoint endpoint(path);
+			acceptor.open(endpoint.protocol());
+			acceptor.bind(endpoint);
+			acceptor.listen();
+
+			start_accept();
+		}
+
+		void close()
+		{
+			boost::system::error_code ignored;
+			acceptor.close(ignored);
+			peer.close(ignored);
+		}
+
+	private:
+		void start_accept()
+		{
+			acceptor.async_accept(
+				peer,
+				boost::bind(&listener_handoff_server::handle_accept, this, boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_accept(const boost::system::error_code &error)
+		{
+			if (error)
+				return;
+
+			boost::system::error_code send_error;
+			send_descriptors(peer.native_handle(), fds, send_error);
+			if (send_error)
+			{
+				retry();
+				return;
+			}
+
+			boost::asio::async_read(
+				peer,
+				boost::asio::buffer(ack),
+				boost::bind(&listener_handoff_server::handle_ack, this, boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_ack(const boost::system::error_code &error)
+		{
+			// no ack: the new process died before it was accepting, keep
+			// serving so that the next attempt can take over
+			if (error)
+			{
+				retry();
+				return;
+			}
+
+			close();
+			on_handed_off();
+		}
+
+		void retry()
+		{
+			boost::system::error_code ignored;
+			peer.close(ignored);
+			start_accept();
+		}
+
+		boost::asio::local::stream_protocol::acceptor	acceptor;
+		boost::asio::local::stream_protocol::socket		peer;
+		std::vector<int>								fds;
+		boost::function<void ()>						on_handed_off;
+		char											ack[1];
+};
+
+/**
+ * new process side: takes over the listening descriptors served on "path".
+ * descriptors() is empty when nothing serves "path", e.g. on a first start;
+ * the server then binds its own listeners as usual.
+ *
+ * acknowledge() once the descriptors are assigned and being accepted on;
+ * that is the old process' signal to stop accepting.
+ */
+class listener_handoff_client
+{
+	public:
+		explicit listener_handoff_client(const std::string &path) : socket(-1)
+		{
+			struct sockaddr_un address;
+			std::memset(&address, 0, sizeof(address));
+			address.sun_family = AF_UNIX;
+			if (path.size() >= sizeof(address.sun_path))
+				return;
+			std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+			socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (socket < 0)
+				return;
+
+			if (::connect(socket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0)
+			{
+				close();
+				return;
+			}
+
+			boost::system::error_code error;
+			fds = receive_descriptors(socket, error);
+			if (error)
+				close();
+		}
+
+		~listener_handoff_client()
+		{
+			close();
+		}
+
+		const std::vector<int>& descriptors() const
+		{
+			return fds;
+		}
+
+		void acknowledge()
+		{
+			if (socket < 0)
+				return;
+
+			char ack = 1;
+			ssize_t ignored = ::write(socket, &ack, 1);
+			(void)ignored;
+			close();
+		}
+
+	private:
+		listener_handoff_client(const listener_handoff_client&);
+		listener_handoff_client& operator=(const listener_handoff_client&);
+
+		void close()
+		{
+			if (socket >= 0)
+				::close(socket);
+			socket = -1;
+		}
+
+		int					socket;
+		std::vector<int>	fds;
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef RESOLVER_CACHE_HPP
+#define RESOLVER_CACHE_HPP
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * host name -> addresses, resolved at most once per name per TTL
+ *
+ * successful lookups are kept for "ttl", failed ones for "negative_ttl", so
+ * a name that does not resolve is not asked for again on every reconnect.
+ * Concurrent async_resolve() calls for a name that is being looked up join
+ * that lookup instead of starting their own (single flight). Numeric
+ * addresses never reach the resolver. A lookup that was cancelled is not
+ * cached, and expired entries are purged at most once per "ttl" as new ones
+ * are stored, so the cache holds about the names used within a ttl.
+ *
+ * only addresses are cached, callers put their own port on them; this is
+ * why no service name has to be made up for the query. Safe to use from
+ * several threads.
+ */
+class resolver_cache
+{
+	public:
+		typedef std::vector<boost::asio::ip::address>			address_list;
+		typedef boost::shared_ptr<const address_list>			addresses_ptr;
+		typedef boost::function<void (const boost::system::error_code&, addresses_ptr)>	handler_type;
+
+		struct cache_stats
+		{
+			cache_stats() : hits(0), lookups(0), coalesced(0) {}
+
+			unsigned long hits;			// answered from the cache
+			unsigned long lookups;		// queries sent to the resolver
+			unsigned long coalesced;	// joined a lookup already in flight
+		};
+
+		resolver_cache(
+				boost::asio::io_service &io_service,
+				std::chrono::seconds ttl = std::chrono::seconds(60),
+				std::chrono::seconds negative_ttl = std::chrono::seconds(5)
+		) :
+			io_service(io_service),
+			ttl(ttl),
+			negative_ttl(negative_ttl),
+			next_purge(std::chrono::steady_clock::now() + ttl)
+		{}
+
+		/**
+		 * calls handler(error, addresses) from the io_service, never from
+		 * inside async_resolve(); on error the address list is empty
+		 */
+		void async_resolve(const std::string &host, handler_type handler)
+		{
+			boost::system::error_code error;
+			addresses_ptr addresses;
+
+			if (numeric(host, addresses))
+			{
+				io_service.post([handler, addresses]() { handler(boost::system::error_code(), addresses); });
+				return;
+			}
+
+			boost::mutex::scoped_lock lock(mutex);
+			entry &e = entries[host];
+
+			if (!e.in_flight && e.resolved && std::chrono::steady_clock::now() < e.expires)
+			{
+				stats_.hits++;
+				error = e.error;
+				addresses = e.addresses;
+				io_service.post([handler, error, addresses]() { handler(error, addresses); });
+				return;
+			}
+
+			e.waiters.push_back(handler);
+			if (e.in_flight)
+			{
+				stats_.coalesced++;
+				return;
+			}
+
+			e.in_flight = true;
+			stats_.lookups++;
+			lock.unlock();
+
+			boost::shared_ptr<boost::asio::ip::tcp::resolver> resolver =
+				boost::make_shared<boost::asio::ip::tcp::resolver>(io_service);
+			resolver->async_resolve(
+				query(host),
+				[this, host, resolver](const boost::system::error_code &error,
+									   boost::asio::ip::tcp::resolver::iterator it)
+				{
+					complete(host, error, it);
+				}
+			);
+		}
+
+		/**
+		 * blocking lookup through the same cache, only for code that runs
+		 * before the io_service does (e.g. listener setup)
+		 *
+		 * an async_resolve() in flight completes through the io_service, so
+		 * waiting for it here could wait forever; finding one is a misuse and
+		 * asserts. async_resolve() calls made during the lookup join it, their
+		 * handlers are posted once it is done.
+		 */
+		addresses_ptr resolve(const std::string &host, boost::system::error_code &error)
+		{
+			addresses_ptr addresses;
+			error = boost::system::error_code();
+
+			if (numeric(host, addresses))
+				return addresses;
+
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				entry &e = entries[host];
+				assert(!e.in_flight && "resolve() while the io_service resolves the same name");
+				if (e.resolved && std::chrono::steady_clock::now() < e.expires)
+				{
+					stats_.hits++;
+					error = e.error;
+					return e.addresses;
+				}
+				e.in_flight = true;
+				stats_.lookups++;
+			}
+
+			boost::asio::ip::tcp::resolver resolver(io_service);
+			boost::asio::ip::tcp::resolver::iterator it = resolver.resolve(query(host), error);
+			addresses = store(host, error, it);
+
+			std::vector<handler_type> waiters = finish(host);
+			for (size_t i = 0; i < waiters.size(); i++)
+			{
+				handler_type handler = waiters[i];
+				io_service.post([handler, error, addresses]() { handler(error, addresses); });
+			}
+			return addresses;
+		}
+
+		cache_stats stats() const
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			return stats_;
+		}
+
+	private:
+		resolver_cache(const resolver_cache&);
+		resolver_cache& operator=(const resolver_cache&);
+
+		struct entry
+		{
+			entry() : resolved(false), in_flight(false) {}
+
+			bool									resolved;
+			bool									in_flight;
+			boost::system::error_code				error;
+			addresses_ptr							addresses;
+			std::chrono::steady_clock::time_point	expires;
+			std::vector<handler_type>				waiters;
+		};
+
+		static boost::asio::ip::tcp::resolver::query query(const std::string &host)
+		{
+			// "0" with numeric_service: any port will do, we only keep the addresses;
+			// address_configured: no IPv6 addresses on a host without IPv6
+			return boost::asio::ip::tcp::resolver::query(
+				host, "0",
+				boost::asio::ip::tcp::resolver::query::address_configured |
+				boost::asio::ip::tcp::resolver::query::numeric_service
+			);
+		}
+
+		static bool numeric(const std::string &host, addresses_ptr &addresses)
+		{
+			boost::system::error_code error;
+			boost::asio::ip::address address = boost::asio::ip::address::from_string(host, error);
+			if (error)
+				return false;
+
+			addresses = boost::make_shared<const address_list>(1, address);
+			return true;
+		}
+
+		addresses_ptr store(
+				const std::string &host,
+				const boost::system::error_code &error,
+				boost::asio::ip::tcp::resolver::iterator it
+		)
+		{
+			boost::shared_ptr<address_list> addresses = boost::make_shared<address_list>();
+			if (!error)
+				for (boost::asio::ip::tcp::resolver::iterator end; it != end; ++it)
+					addresses->push_back(it->endpoint().address());
+
+			// a cancelled lookup says nothing about the name
+			if (error == boost::asio::error::operation_aborted)
+				return addresses;
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			boost::mutex::scoped_lock lock(mutex);
+			entry &e = entries[host];
+			e.resolved = true;
+			e.error = error;
+			e.addresses = addresses;
+			e.expires = now + (error ? negative_ttl : ttl);
+
+			if (now >= next_purge)
+			{
+				purge(now);
+				next_purge = now + ttl;
+			}
+			return addresses;
+		}
+
+		/**
+		 * drops the entries that expired or were never resolved, except those
+		 * with a lookup in flight; called with the lock held
+		 */
+		void purge(std::chrono::steady_clock::time_point now)
+		{
+			for (auto it = entries.begin(); it != entries.end(); )
+			{
+				if (!it->second.in_flight && (!it->second.resolved || it->second.expires <= now))
+					it = entries.erase(it);
+				else
+					++it;
+			}
+		}
+
+		void complete(
+				const std::string &host,
+				const boost::system::error_code &error,
+				boost::asio::ip::tcp::resolver::iterator it
+		)
+		{
+			addresses_ptr addresses = store(host, error, it);
+
+			std::vector<handler_type> waiters = finish(host);
+			for (size_t i = 0; i < waiters.size(); i++)
+				waiters[i](error, addresses);
+		}
+
+		/**
+		 * ends the lookup of "host" once its result is stored, returns the
+		 * handlers that joined it
+		 */
+		std::vector<handler_type> finish(const std::string &host)
+		{
+			std::vector<handler_type> waiters;
+
+			boost::mutex::scoped_lock lock(mutex);
+			entry &e = entries[host];
+			e.in_flight = false;
+			waiters.swap(e.waiters);
+			if (!e.resolved)
+				entries.erase(host);		// cancelled, see store()
+			return waiters;
+		}
+
+		boost::asio::io_service								&io_service;
+		std::chrono::seconds								ttl;
+		std::chrono::seconds								negative_ttl;
+		mutable boost::mutex								mutex;
+		std::unordered_map<std::string, entry>				entries;
+		std::chrono::steady_clock::time_point				next_purge;
+		cache_stats											stats_;
+};
+
+#endif
@@ -0,0 +1,325 @@
+// Asynchronous HTTP/1.1 client with keep-alive and pipelining
+//
+// usage: http_client [host [port [requests [depth [path...]]]]]
+//        defaults: 127.0.0.1 8080 1000 16 /
+//
+// Grown out of asio_ip_tcp_example_one.cpp: instead of one GET per connection
+// and raw bytes dumped to stdout, it keeps one connection alive and up to
+// "depth" GETs in flight on it, cycling through the given paths, and parses the
+// responses as they stream in with http_response_parser. Body slices are
+// consumed straight out of the receive buffer; only an incomplete header line
+// is ever moved (to the front of the buffer, before the next read).
+//
+// When the server closes the connection ("Connection: close", or a body
+// delimited by the close), requests that were sent but not answered are sent
+// again on a new connection. Bodies are printed when at most 10 requests are
+// made, otherwise only counted.
+//
+// Start http_test_server to have a local host to talk to.
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "http_response_parser.hpp"
+
+using boost::asio::ip::tcp;
+
+const size_t RECEIVE_BUFFER_SIZE = 65536;
+
+class http_client
+{
+	public:
+		http_client(
+				boost::asio::io_service& io_service,
+				const std::string& host,
+				const std::string& port,
+				const std::vector<std::string>& paths,
+				unsigned long requests,
+				unsigned int depth
+		) :
+			socket_(io_service),
+			total_(requests),
+			depth_(depth),
+			print_bodies_(requests <= 10),
+			next_to_send_(0),
+			answered_(0),
+			connection_(0),
+			writing_(false),
+			reconnect_(false),
+			status_(0),
+			buffer_(RECEIVE_BUFFER_SIZE),
+			begin_(0),
+			end_(0),
+			body_bytes_(0),
+			connects_(0),
+			failed_(false)
+		{
+			// resolved once, every reconnect reuses the endpoints
+			tcp::resolver resolver(io_service);
+			endpoints_ = resolver.resolve(tcp::resolver::query(host, port));
+
+			for (auto& path: paths)
+				requests_.push_back("GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+		}
+
+		void start()
+		{
+			started_ = std::chrono::steady_clock::now();
+			connect();
+		}
+
+		void report(std::ostream& out) const
+		{
+			double seconds = std::chrono::duration<double>(finished_ - started_).count();
+
+			out << answered_ << " responses in " << seconds << " s, " << answered_ / seconds
+				<< " responses/sec, depth " << depth_ << ", " << connects_ << " connection(s), "
+				<< body_bytes_ << " body bytes\n";
+			for (auto& s: statuses_)
+				out << "  status " << s.first << ": " << s.second << "\n";
+		}
+
+		bool failed() const
+		{
+			return failed_;
+		}
+
+		// http_response_parser callbacks
+
+		void on_status(int code, boost::string_ref)
+		{
+			status_ = code;
+		}
+
+		void on_header(boost::string_ref, boost::string_ref)
+		{}
+
+		void on_body(const char* data, size_t size)
+		{
+			body_bytes_ += size;
+			if (print_bodies_)
+				std::cout.write(data, size);
+		}
+
+		void on_complete(bool keep_alive)
+		{
+			answered_++;
+			statuses_[status_]++;
+
+			if (!keep_alive)
+				reconnect_ = true;
+		}
+
+	private:
+		void connect()
+		{
+			boost::system::error_code ignored;
+			socket_.close(ignored);
+
+			// anything sent on the old connection and not answered goes again
+			connection_++;
+			next_to_send_ = answered_;
+			writing_ = false;
+			reconnect_ = false;
+			parser_ = http_response_parser();
+			begin_ = end_ = 0;
+
+			unsigned long connection = connection_;
+			boost::asio::async_connect(socket_, endpoints_,
+				[this, connection](const boost::system::error_code& error, tcp::resolver::iterator)
+				{
+					if (connection != connection_)
+						return;
+					if (error)
+					{
+						fail("connect", error);
+						return;
+					}
+
+					connects_++;
+					socket_.set_option(tcp::no_delay(true));
+					fill_window();
+					do_read();
+				});
+		}
+
+		// sends as many requests as the window allows in one gather write
+		void fill_window()
+		{
+			if (writing_)
+				return;
+
+			gather_.clear();
+			while (next_to_send_ < total_ && next_to_send_ - answered_ < depth_)
+			{
+				const std::string& request = requests_[next_to_send_ % requests_.size()];
+				gather_.push_back(boost::asio::buffer(request));
+				next_to_send_++;
+			}
+			if (gather_.empty())
+				return;
+
+			writing_ = true;
+			unsigned long connection = connection_;
+			boost::asio::async_write(socket_, gather_,
+				[this, connection](const boost::system::error_code& error, size_t)
+				{
+					if (connection != connection_)
+						return;
+
+					writing_ = false;
+					if (error)
+					{
+						connect();			// the read side sees the same error
+						return;
+					}
+					fill_window();
+				});
+		}
+
+		void do_read()
+		{
+			// only an incomplete line or nothing is left over, move it to the front
+			if (begin_ > 0)
+			{
+				std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+				end_ -= begin_;
+				begin_ = 0;
+			}
+
+			unsigned long connection = connection_;
+			socket_.async_read_some(
+				boost::asio::buffer(buffer_.data() + end_, buffer_.size() - end_),
+				[this, connection](const boost::system::error_code& error, size_t bytes_read)
+				{
+					if (connection != connection_)
+						return;
+					handle_read(error, bytes_read);
+				});
+		}
+
+		void handle_read(const boost::system::error_code& error, size_t bytes_read)
+		{
+			if (error)
+			{
+				if (error != boost::asio::error::eof)
+				{
+					fail("read", error);
+					return;
+				}
+
+				if (!parser_.finish(*this))
+				{
+					fail("read", boost::asio::error::connection_aborted);
+					return;
+				}
+				reconnect_ = true;
+			}
+			else
+			{
+				end_ += bytes_read;
+				begin_ += parser_.parse(buffer_.data() + begin_, end_ - begin_, *this);
+
+				if (parser_.failed())
+				{
+					std::cerr << "malformed response\n";
+					failed_ = true;
+					finish();
+					return;
+				}
+			}
+
+			if (answered_ == total_)
+			{
+				finish();
+				return;
+			}
+
+			if (reconnect_)
+			{
+				connect();
+				return;
+			}
+
+			fill_window();
+			do_read();
+		}
+
+		void finish()
+		{
+			finished_ = std::chrono::steady_clock::now();
+			boost::system::error_code ignored;
+			socket_.close(ignored);
+		}
+
+		void fail(const char* what, const boost::system::error_code& error)
+		{
+			std::cerr << what << " failed: " << error.message() << "\n";
+			failed_ = true;
+			finish();
+		}
+
+		tcp::socket									socket_;
+		tcp::resolver::iterator						endpoints_;
+		std::vector<std::string>					requests_;			// one per path
+		unsigned long								total_;
+		unsigned int								depth_;
+		bool										print_bodies_;
+
+		unsigned long								next_to_send_;		// index of the next request
+		unsigned long								answered_;
+		unsigned long								connection_;		// handlers of older connections are ignored
+		bool										writing_;
+		bool										reconnect_;
+		std::vector<boost::asio::const_buffer>		gather_;
+
+		http_response_parser						parser_;
+		int											status_;
+		std::vector<char>							buffer_;
+		size_t										begin_;				// unparsed bytes are [begin_, end_)
+		size_t										end_;
+
+		unsigned long long							body_bytes_;
+		unsigned long								connects_;
+		std::map<int, unsigned long>				statuses_;
+		bool										failed_;
+		std::chrono::steady_clock::time_point		started_;
+		std::chrono::steady_clock::time_point		finished_;
+};
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+		std::string port = argc > 2 ? argv[2] : "8080";
+		unsigned long requests = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1000;
+		unsigned int depth = argc > 4 ? std::max(1ul, std::strtoul(argv[4], nullptr, 10)) : 16;
+
+		std::vector<std::string> paths;
+		for (int i = 5; i < argc; i++)
+			paths.push_back(argv[i]);
+		if (paths.empty())
+			paths.push_back("/");
+
+		boost::asio::io_service io_service;
+		http_client client(io_service, host, port, paths, requests, depth);
+
+		client.start();
+		io_service.run();
+
+		client.report(std::cerr);
+		return client.failed() ? 1 : 0;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+}
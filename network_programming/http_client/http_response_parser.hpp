@@ -0,0 +1,362 @@
+#ifndef HTTP_RESPONSE_PARSER_HPP
+#define HTTP_RESPONSE_PARSER_HPP
+
+#include <boost/utility/string_ref.hpp>
+#include <cstddef>
+#include <cstring>
+#include <strings.h>
+
+/**
+ * incremental HTTP/1.1 response parser
+ *
+ * parse() is fed whatever the socket delivered and reports how many bytes it
+ * consumed. Header lines are only consumed once complete, so the caller keeps
+ * the unconsumed tail and appends the next read to it. Nothing is copied:
+ * status, headers and body slices are handed to the handler as spans of the
+ * caller's buffer, valid until the callback returns.
+ *
+ * bodies may be delimited by Content-Length, chunked transfer encoding or
+ * the end of the connection (finish()). Several pipelined responses in one
+ * buffer are parsed back to back.
+ *
+ * the handler provides:
+ *  void on_status(int code, boost::string_ref reason)
+ *  void on_header(boost::string_ref name, boost::string_ref value)
+ *  void on_body(const char *data, size_t size)
+ *  void on_complete(bool keep_alive)
+ */
+class http_response_parser
+{
+	public:
+		static const size_t MAX_LINE = 8192;
+
+		http_response_parser()
+		{
+			start_message();
+		}
+
+		/**
+		 * parses as much of [data, data + size) as possible, returns the
+		 * number of bytes consumed; stops at the first error
+		 */
+		template <typename Handler>
+		size_t parse(const char *data, size_t size, Handler &handler)
+		{
+			size_t pos = 0;
+
+			while (pos < size && state != error)
+			{
+				if (state == body_length || state == chunk_data || state == body_until_close)
+				{
+					size_t take = size - pos;
+					if (state != body_until_close && take > remaining)
+						take = static_cast<size_t>(remaining);
+
+					handler.on_body(data + pos, take);
+					pos += take;
+
+					if (state == body_until_close)
+						continue;
+
+					remaining -= take;
+					if (remaining == 0)
+					{
+						if (state == chunk_data)
+							state = chunk_data_end;
+						else
+							complete(handler);
+					}
+					continue;
+				}
+
+				// every other state works on whole lines
+				const char *newline = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+				if (!newline)
+				{
+					if (size - pos > MAX_LINE)
+						state = error;
+					break;
+				}
+
+				size_t end = newline - data;
+				size_t line_end = (end > pos && data[end - 1] == '\r') ? end - 1 : end;
+				boost::string_ref line(data + pos, line_end - pos);
+				pos = end + 1;
+
+				parse_line(line, handler);
+			}
+
+			return pos;
+		}
+
+		/**
+		 * the connection ended; completes a body delimited by the close,
+		 * returns false if a message was cut short
+		 */
+		template <typename Handler>
+		bool finish(Handler &handler)
+		{
+			if (state == body_until_close)
+			{
+				complete(handler);
+				return true;
+			}
+			return state == status_line && !seen_status;
+		}
+
+		bool failed() const
+		{
+			return state == error;
+		}
+
+		/**
+		 * true between the status line and the end of its message
+		 */
+		bool in_message() const
+		{
+			return seen_status;
+		}
+
+	private:
+		enum parse_state
+		{
+			status_line,
+			header_line,
+			body_length,
+			chunk_size_line,
+			chunk_data,
+			chunk_data_end,		// the CRLF after a chunk's data
+			trailer_line,
+			body_until_close,
+			error
+		};
+
+		void start_message()
+		{
+			state = status_line;
+			seen_status = false;
+			status = 0;
+			remaining = 0;
+			chunked = false;
+			has_length = false;
+			keep_alive = true;
+		}
+
+		template <typename Handler>
+		void parse_line(boost::string_ref line, Handler &handler)
+		{
+			switch (state)
+			{
+				case status_line:
+					if (line.empty())
+						return;			// tolerate stray CRLF between responses
+					parse_status(line, handler);
+					return;
+
+				case header_line:
+					if (line.empty())
+						headers_done(handler);
+					else
+						parse_header(line, handler);
+					return;
+
+				case chunk_size_line:
+					parse_chunk_size(line);
+					return;
+
+				case chunk_data_end:
+					state = line.empty() ? chunk_size_line : error;
+					return;
+
+				case trailer_line:
+					if (line.empty())
+						complete(handler);
+					return;
+
+				default:
+					state = error;
+			}
+		}
+
+		// HTTP/1.1 200 OK
+		template <typename Handler>
+		void parse_status(boost::string_ref line, Handler &handler)
+		{
+			if (line.size() < 12 || !line.starts_with("HTTP/1.") || line[8] != ' ')
+			{
+				state = error;
+				return;
+			}
+
+			// HTTP/1.0 closes after every response unless asked otherwise
+			keep_alive = line[7] != '0';
+
+			status = 0;
+			for (size_t i = 9; i < 12; i++)
+			{
+				if (line[i] < '0' || line[i] > '9')
+				{
+					state = error;
+					return;
+				}
+				status = status * 10 + (line[i] - '0');
+			}
+
+			boost::string_ref reason = line.substr(12);
+			if (!reason.empty() && reason[0] == ' ')
+				reason.remove_prefix(1);
+
+			seen_status = true;
+			state = header_line;
+			handler.on_status(status, reason);
+		}
+
+		template <typename Handler>
+		void parse_header(boost::string_ref line, Handler &handler)
+		{
+			size_t colon = line.find(':');
+			if (colon == boost::string_ref::npos || colon == 0)
+			{
+				state = error;
+				return;
+			}
+
+			boost::string_ref name = line.substr(0, colon);
+			boost::string_ref value = trim(line.substr(colon + 1));
+
+			if (equals(name, "content-length"))
+			{
+				remaining = 0;
+				if (value.empty())
+				{
+					state = error;
+					return;
+				}
+				for (size_t i = 0; i < value.size(); i++)
+				{
+					// a length past 2^60 is as bogus as a non-digit
+					if (value[i] < '0' || value[i] > '9' || (remaining >> 60))
+					{
+						state = error;
+						return;
+					}
+					remaining = remaining * 10 + (value[i] - '0');
+				}
+				has_length = true;
+			}
+			else if (equals(name, "transfer-encoding"))
+				chunked = ends_with_token(value, "chunked");
+			else if (equals(name, "connection"))
+			{
+				if (equals(value, "close"))
+					keep_alive = false;
+				else if (equals(value, "keep-alive"))
+					keep_alive = true;
+			}
+
+			handler.on_header(name, value);
+		}
+
+		template <typename Handler>
+		void headers_done(Handler &handler)
+		{
+			// 1xx, 204 and 304 never carry a body
+			if (status / 100 == 1 || status == 204 || status == 304)
+			{
+				if (status / 100 == 1)
+					start_message();			// the real response follows
+				else
+					complete(handler);
+				return;
+			}
+
+			if (chunked)
+				state = chunk_size_line;
+			else if (has_length)
+			{
+				state = body_length;
+				if (remaining == 0)
+					complete(handler);
+			}
+			else
+			{
+				keep_alive = false;				// only the close delimits the body
+				state = body_until_close;
+			}
+		}
+
+		void parse_chunk_size(boost::string_ref line)
+		{
+			size_t digits = 0;
+			remaining = 0;
+			for (; digits < line.size(); digits++)
+			{
+				char c = line[digits];
+				int value;
+				if (c >= '0' && c <= '9')
+					value = c - '0';
+				else if (c >= 'a' && c <= 'f')
+					value = c - 'a' + 10;
+				else if (c >= 'A' && c <= 'F')
+					value = c - 'A' + 10;
+				else
+					break;				// chunk extensions follow ';'
+
+				if (remaining >> 60)
+				{
+					state = error;
+					return;
+				}
+				remaining = remaining * 16 + value;
+			}
+
+			if (digits == 0)
+			{
+				state = error;
+				return;
+			}
+
+			state = remaining ? chunk_data : trailer_line;
+		}
+
+		template <typename Handler>
+		void complete(Handler &handler)
+		{
+			bool reuse = keep_alive;
+			start_message();
+			handler.on_complete(reuse);
+		}
+
+		static boost::string_ref trim(boost::string_ref s)
+		{
+			while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+				s.remove_prefix(1);
+			while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+				s.remove_suffix(1);
+			return s;
+		}
+
+		static bool equals(boost::string_ref a, const char *b)
+		{
+			return a.size() == std::strlen(b) && ::strncasecmp(a.data(), b, a.size()) == 0;
+		}
+
+		// "gzip, chunked": chunked must be the last coding applied
+		static bool ends_with_token(boost::string_ref value, const char *token)
+		{
+			size_t comma = value.rfind(',');
+			if (comma != boost::string_ref::npos)
+				value = trim(value.substr(comma + 1));
+			return equals(value, token);
+		}
+
+		parse_state				state;
+		bool					seen_status;
+		int						status;
+		unsigned long long		remaining;		// of the body or the current chunk
+		bool					chunked;
+		bool					has_length;
+		bool					keep_alive;
+};
+
+#endif
@@ -0,0 +1,226 @@
+// Local HTTP/1.1 server for http_client
+//
+// usage: http_test_server [port]        (8080)
+//
+// Stands in for a real host. It answers every GET on a kept-alive connection,
+// in order, so pipelined requests work, and picks the framing from the path:
+//   /chunked     body sent as three chunks
+//   /big         64KB body with Content-Length
+//   /close       Content-Length body, then "Connection: close"
+//   /empty       204, no body
+//   anything     short Content-Length body naming the path
+// Request bodies are not supported, the server only looks at request lines.
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+class http_test_connection : public boost::enable_shared_from_this<http_test_connection>
+{
+	public:
+		typedef boost::shared_ptr<http_test_connection> pointer;
+
+		explicit http_test_connection(boost::asio::io_service& io_service) :
+			socket_(io_service),
+			writing_(false),
+			closing_(false)
+		{}
+
+		tcp::socket& socket()
+		{
+			return socket_;
+		}
+
+		void start()
+		{
+			do_read();
+		}
+
+	private:
+		void do_read()
+		{
+			socket_.async_read_some(
+				boost::asio::buffer(chunk_),
+				boost::bind(
+					&http_test_connection::handle_read,
+					shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred
+				)
+			);
+		}
+
+		void handle_read(const boost::system::error_code& error, size_t bytes_read)
+		{
+			if (error)
+				return;
+
+			input_.append(chunk_.data(), bytes_read);
+
+			// every request ends with an empty line
+			size_t end;
+			while (!closing_ && (end = input_.find("\r\n\r\n")) != std::string::npos)
+			{
+				respond(input_.substr(0, input_.find("\r\n")));
+				input_.erase(0, end + 4);
+			}
+
+			if (!writing_ && !pending_.empty())
+				do_write();
+
+			if (!closing_)
+				do_read();
+		}
+
+		// "GET /path HTTP/1.1"
+		void respond(const std::string& request_line)
+		{
+			size_t first = request_line.find(' ');
+			size_t second = request_line.find(' ', first + 1);
+			if (first == std::string::npos || second == std::string::npos)
+			{
+				pending_ += "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+				closing_ = true;
+				return;
+			}
+
+			std::string path = request_line.substr(first + 1, second - first - 1);
+
+			if (path == "/chunked")
+			{
+				pending_ +=
+					"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+					"6\r\nhello \r\n"
+					"7;ext=1\r\nchunked\r\n"
+					"7\r\n world\n\r\n"
+					"0\r\n\r\n";
+			}
+			else if (path == "/big")
+			{
+				pending_ += "HTTP/1.1 200 OK\r\nContent-Length: 65536\r\n\r\n";
+				pending_.append(65536, 'x');
+			}
+			else if (path == "/empty")
+				pending_ += "HTTP/1.1 204 No Content\r\n\r\n";
+			else
+			{
+				std::string body = "hello from " + path + "\n";
+				pending_ += "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: "
+						 + std::to_string(body.size()) + "\r\n";
+				if (path == "/close")
+				{
+					pending_ += "Connection: close\r\n";
+					closing_ = true;
+				}
+				pending_ += "\r\n" + body;
+			}
+		}
+
+		void do_write()
+		{
+			writing_ = true;
+			output_.swap(pending_);
+			pending_.clear();
+
+			boost::asio::async_write(
+				socket_,
+				boost::asio::buffer(output_),
+				boost::bind(
+					&http_test_connection::handle_write,
+					shared_from_this(),
+					boost::asio::placeholders::error
+				)
+			);
+		}
+
+		void handle_write(const boost::system::error_code& error)
+		{
+			writing_ = false;
+			if (error)
+				return;
+
+			if (!pending_.empty())
+				do_write();
+			else if (closing_)
+			{
+				boost::system::error_code ignored;
+				socket_.shutdown(tcp::socket::shutdown_both, ignored);
+			}
+		}
+
+		tcp::socket					socket_;
+		std::array<char, 4096>		chunk_;
+		std::string					input_;
+		std::string					pending_;		// responses not yet handed to the socket
+		std::string					output_;		// responses being written
+		bool						writing_;
+		bool						closing_;
+};
+
+class http_test_server
+{
+	public:
+		http_test_server(boost::asio::io_service& io_service, unsigned short port) :
+			io_service_(io_service),
+			acceptor_(io_service)
+		{
+			tcp::endpoint endpoint(tcp::v4(), port);
+			acceptor_.open(endpoint.protocol());
+			acceptor_.set_option(tcp::acceptor::reuse_address(true));
+			acceptor_.bind(endpoint);
+			acceptor_.listen();
+
+			start_accept();
+		}
+
+	private:
+		void start_accept()
+		{
+			http_test_connection::pointer connection = boost::make_shared<http_test_connection>(io_service_);
+			acceptor_.async_accept(
+				connection->socket(),
+				boost::bind(&http_test_server::handle_accept, this, connection, boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_accept(http_test_connection::pointer connection, const boost::system::error_code& error)
+		{
+			if (!error)
+				connection->start();
+
+			start_accept();
+		}
+
+		boost::asio::io_service&	io_service_;
+		tcp::acceptor				acceptor_;
+};
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		unsigned short port = argc > 1 ? static_cast<unsigned short>(std::atoi(argv[1])) : 8080;
+
+		boost::asio::io_service io_service;
+		http_test_server server(io_service, port);
+
+		std::cerr << "HTTP test server on port " << port << "\n";
+		io_service.run();
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
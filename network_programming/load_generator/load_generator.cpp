@@ -0,0 +1,604 @@
+// Multi-threaded load generator for the servers in this repository.
+//
+// usage: load_generator [--option value]...
+//
+//   --host        server address                              (127.0.0.1)
+//   --port        server port                                 (11235)
+//   --protocol    line     '\n' terminated requests, the reply is the
+//                          request echoed without its '\n' (my_server,
+//                          my_async_server)
+//                 nul      '\0' terminated messages, no reply is expected,
+//                          a request completes when it has been written
+//                          (async_server)
+//                 daytime  connect, read until the server closes, repeat
+//                          (daytime servers, port 13 / 2014)        (line)
+//   --connections concurrent connections                      (16)
+//   --threads     client threads, one io_service each          (2)
+//   --size        request size in bytes, terminator included   (64)
+//   --pipeline    requests in flight per connection            (1)
+//   --rate        total requests per second, 0 = closed loop   (0)
+//   --duration    measured seconds                             (10)
+//   --warmup      seconds run before measuring starts          (1)
+//   --format      text     human readable summary
+//                 csv      one line of fields, see print_csv_header()
+//                 json     one object with the same fields        (text)
+//
+// Open loop (--rate > 0): every connection sends on a fixed schedule whether
+// or not earlier requests were answered, and latency is measured from the
+// time a request was *scheduled*, not from when it could actually be sent.
+// A server stall therefore shows up in the latency of every request that
+// should have been sent during the stall, which avoids coordinated omission.
+// Closed loop (--rate 0): a request is sent as soon as the pipeline has room
+// and latency is measured from that moment.
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "../common/latency_histogram.hpp"
+
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock	clock_type;
+
+struct options
+{
+	options() :
+		host("127.0.0.1"),
+		port(11235),
+		protocol("line"),
+		connections(16),
+		threads(2),
+		size(64),
+		pipeline(1),
+		rate(0),
+		duration(10),
+		warmup(1),
+		format("text")
+	{}
+
+	std::string		host;
+	unsigned short	port;
+	std::string		protocol;
+	size_t			connections;
+	size_t			threads;
+	size_t			size;
+	size_t			pipeline;
+	double			rate;
+	double			duration;
+	double			warmup;
+	std::string		format;
+};
+
+/**
+ * results of one client thread, merged once all threads are done
+ */
+struct thread_stats
+{
+	thread_stats() : completed(0), bytes(0), errors(0) {}
+
+	latency_histogram	latency;		// nanoseconds
+	size_t				completed;
+	size_t				bytes;
+	size_t				errors;
+};
+
+/**
+ * what every connection needs to know about the run
+ */
+struct run_context
+{
+	options					opts;
+	tcp::endpoint			endpoint;
+	clock_type::time_point	measure_from;	// end of warmup
+	clock_type::time_point	stop_at;
+};
+
+/**
+ * one connection speaking the line or nul protocol
+ */
+class stream_client : public boost::enable_shared_from_this<stream_client>
+{
+	public:
+		stream_client(boost::asio::io_service &io_service, const run_context &context, thread_stats &stats) :
+			context(context),
+			stats(stats),
+			socket(io_service),
+			timer(io_service),
+			reply_size(context.opts.protocol == "line" ? context.opts.size - 1 : 0),
+			reply_received(0),
+			writing(false),
+			read_buffer(64 * 1024)
+		{
+			// request "size" bytes including its terminator, repeated "pipeline"
+			// times so a batch of queued requests goes out in a single write
+			std::string request(context.opts.size - 1, 'x');
+			request += (context.opts.protocol == "line") ? '\n' : '\0';
+			for (size_t i = 0; i < context.opts.pipeline; i++)
+				requests += request;
+		}
+
+		void start()
+		{
+			socket.async_connect(
+				context.endpoint,
+				boost::bind(&stream_client::handle_connect, shared_from_this(), boost::asio::placeholders::error)
+			);
+		}
+
+	private:
+		void handle_connect(const boost::system::error_code &error)
+		{
+			if (error)
+			{
+				stats.errors++;
+				return;
+			}
+
+			socket.set_option(tcp::no_delay(true));
+
+			if (reply_size > 0)
+				do_read();
+
+			if (context.opts.rate > 0)
+			{
+				interval = std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double>(context.opts.connections / context.opts.rate)
+				);
+				// spread the first sends of all connections over one interval
+				next_send = clock_type::now() + interval * ((reinterpret_cast<size_t>(this) >> 4) % 1000) / 1000;
+				schedule();
+			}
+			else
+			{
+				try_send();
+			}
+		}
+
+		/**
+		 * open loop: queue one request at every tick of the schedule
+		 */
+		void schedule()
+		{
+			if (next_send >= context.stop_at)
+				return;
+
+			timer.expires_at(next_send);
+			timer.async_wait(
+				boost::bind(&stream_client::handle_tick, shared_from_this(), boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_tick(const boost::system::error_code &error)
+		{
+			if (error || !socket.is_open())
+				return;
+
+			// catch up on ticks missed while this thread was busy, each one is a request
+			clock_type::time_point now = clock_type::now();
+			while (next_send <= now && next_send < context.stop_at)
+			{
+				queued.push_back(next_send);
+				next_send += interval;
+			}
+
+			try_send();
+			schedule();
+		}
+
+		void try_send()
+		{
+			if (writing || !socket.is_open())
+				return;
+
+			clock_type::time_point now = clock_type::now();
+			if (now >= context.stop_at)
+			{
+				if (in_flight.empty())
+					close();
+				return;
+			}
+
+			// closed loop: keep the pipeline full, measured from now
+			if (context.opts.rate <= 0)
+				while (queued.size() + in_flight.size() < context.opts.pipeline)
+					queued.push_back(now);
+
+			size_t batch = 0;
+			while (!queued.empty() && in_flight.size() < context.opts.pipeline)
+			{
+				in_flight.push_back(queued.front());
+				queued.pop_front();
+				batch++;
+			}
+
+			if (batch == 0)
+				return;
+
+			writing = true;
+			boost::asio::async_write(
+				socket,
+				boost::asio::buffer(requests.data(), batch * context.opts.size),
+				boost::bind(&stream_client::handle_write, shared_from_this(),
+					boost::asio::placeholders::error, batch)
+			);
+		}
+
+		void handle_write(const boost::system::error_code &error, size_t batch)
+		{
+			writing = false;
+
+			if (error)
+			{
+				stats.errors++;
+				close();
+				return;
+			}
+
+			// nothing comes back: a request is done once it is written
+			if (reply_size == 0)
+				for (size_t i = 0; i < batch; i++)
+					complete(context.opts.size);
+
+			try_send();
+		}
+
+		void do_read()
+		{
+			socket.async_read_some(
+				boost::asio::buffer(read_buffer),
+				boost::bind(&stream_client::handle_read, shared_from_this(),
+					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)
+			);
+		}
+
+		void handle_read(const boost::system::error_code &error, size_t bytes)
+		{
+			if (error)
+			{
+				if (error != boost::asio::error::operation_aborted && clock_type::now() < context.stop_at)
+					stats.errors++;
+				close();
+				return;
+			}
+
+			// replies come back in order and have a known size
+			reply_received += bytes;
+			while (reply_received >= reply_size && !in_flight.empty())
+			{
+				reply_received -= reply_size;
+				complete(reply_size);
+			}
+
+			do_read();
+			try_send();
+		}
+
+		void complete(size_t bytes)
+		{
+			clock_type::time_point intended = in_flight.front();
+			in_flight.pop_front();
+
+			if (intended < context.measure_from)
+				return;
+
+			stats.completed++;
+			stats.bytes += bytes;
+			stats.latency.record(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - intended).count()
+			);
+		}
+
+		void close()
+		{
+			boost::system::error_code ignored;
+			timer.cancel(ignored);
+			socket.close(ignored);
+		}
+
+		const run_context						&context;
+		thread_stats							&stats;
+		tcp::socket								socket;
+		boost::asio::steady_timer				timer;
+		size_t									reply_size;
+		size_t									reply_received;
+		bool									writing;
+		std::string								requests;
+		std::vector<char>						read_buffer;
+		clock_type::duration					interval;
+		clock_type::time_point					next_send;
+		std::deque<clock_type::time_point>		queued;		// scheduled, not yet written
+		std::deque<clock_type::time_point>		in_flight;	// written, not yet answered
+};
+
+/**
+ * daytime: every request is a fresh connection read until the server closes it
+ */
+class daytime_client : public boost::enable_shared_from_this<daytime_client>
+{
+	public:
+		daytime_client(boost::asio::io_service &io_service, const run_context &context, thread_stats &stats) :
+			context(context),
+			stats(stats),
+			socket(io_service),
+			timer(io_service),
+			received(0)
+		{
+			if (context.opts.rate > 0)
+				interval = std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double>(context.opts.connections / context.opts.rate)
+				);
+			next_send = clock_type::now();
+		}
+
+		void start()
+		{
+			clock_type::time_point now = clock_type::now();
+			if (now >= context.stop_at)
+				return;
+
+			// open loop: wait for the next slot unless we are already late for it
+			if (context.opts.rate > 0 && next_send > now)
+			{
+				timer.expires_at(next_send);
+				timer.async_wait(boost::bind(&daytime_client::connect, shared_from_this()));
+				return;
+			}
+			connect();
+		}
+
+	private:
+		void connect()
+		{
+			intended = (context.opts.rate > 0) ? next_send : clock_type::now();
+			next_send += interval;
+			received = 0;
+
+			socket.async_connect(
+				context.endpoint,
+				boost::bind(&daytime_client::handle_connect, shared_from_this(), boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_connect(const boost::system::error_code &error)
+		{
+			if (error)
+			{
+				stats.errors++;
+				finish();
+				return;
+			}
+			do_read();
+		}
+
+		void do_read()
+		{
+			socket.async_read_some(
+				boost::asio::buffer(buffer),
+				boost::bind(&daytime_client::handle_read, shared_from_this(),
+					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)
+			);
+		}
+
+		void handle_read(const boost::system::error_code &error, size_t bytes)
+		{
+			received += bytes;
+
+			if (!error)
+			{
+				do_read();
+				return;
+			}
+
+			if (error == boost::asio::error::eof && intended >= context.measure_from)
+			{
+				stats.completed++;
+				stats.bytes += received;
+				stats.latency.record(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - intended).count()
+				);
+			}
+			else if (error != boost::asio::error::eof)
+			{
+				stats.errors++;
+			}
+			finish();
+		}
+
+		void finish()
+		{
+			boost::system::error_code ignored;
+			socket.close(ignored);
+			start();
+		}
+
+		const run_context				&context;
+		thread_stats					&stats;
+		tcp::socket						socket;
+		boost::asio::steady_timer		timer;
+		char							buffer[1024];
+		size_t							received;
+		clock_type::duration			interval;
+		clock_type::time_point			next_send;
+		clock_type::time_point			intended;
+};
+
+bool parse_options(int argc, char* argv[], options &opts)
+{
+	std::map<std::string, std::string> values;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string key = argv[i];
+		if (key.compare(0, 2, "--") != 0)
+			return false;
+		values[key.substr(2)] = argv[i + 1];
+	}
+	if (argc % 2 == 0)
+		return false;
+
+	for (std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it)
+	{
+		const std::string &key = it->first;
+		const char *value = it->second.c_str();
+
+		if (key == "host")				opts.host = value;
+		else if (key == "port")			opts.port = static_cast<unsigned short>(std::strtoul(value, nullptr, 10));
+		else if (key == "protocol")		opts.protocol = value;
+		else if (key == "connections")	opts.connections = std::strtoul(value, nullptr, 10);
+		else if (key == "threads")		opts.threads = std::strtoul(value, nullptr, 10);
+		else if (key == "size")			opts.size = std::strtoul(value, nullptr, 10);
+		else if (key == "pipeline")		opts.pipeline = std::strtoul(value, nullptr, 10);
+		else if (key == "rate")			opts.rate = std::strtod(value, nullptr);
+		else if (key == "duration")		opts.duration = std::strtod(value, nullptr);
+		else if (key == "warmup")		opts.warmup = std::strtod(value, nullptr);
+		else if (key == "format")		opts.format = value;
+		else
+			return false;
+	}
+
+	return (opts.protocol == "line" || opts.protocol == "nul" || opts.protocol == "daytime")
+		&& (opts.format == "text" || opts.format == "csv" || opts.format == "json")
+		&& opts.connections > 0 && opts.threads > 0 && opts.size >= 2 && opts.pipeline > 0;
+}
+
+void print_text(const options &opts, const thread_stats &total)
+{
+	std::printf("protocol %s, %zu connections, %zu threads, %zu byte requests, pipeline %zu, %s\n",
+		opts.protocol.c_str(), opts.connections, opts.threads, opts.size, opts.pipeline,
+		opts.rate > 0 ? ("open loop at " + std::to_string(static_cast<long>(opts.rate)) + " req/s").c_str() : "closed loop");
+	std::printf("requests   %zu in %.1fs, %zu errors\n", total.completed, opts.duration, total.errors);
+	std::printf("throughput %.0f req/s, %.2f MB/s\n",
+		total.completed / opts.duration, total.bytes / opts.duration / 1e6);
+	std::printf("latency us min %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f  mean %.1f\n",
+		total.latency.min() / 1e3, total.latency.percentile(50) / 1e3, total.latency.percentile(99) / 1e3,
+		total.latency.percentile(99.9) / 1e3, total.latency.max() / 1e3, total.latency.mean() / 1e3);
+}
+
+// the fields of --format csv and json, in this order
+const char *RESULT_FIELDS =
+	"protocol,connections,threads,size,pipeline,rate,duration,completed,errors,"
+	"requests_per_sec,mb_per_sec,min_us,p50_us,p90_us,p99_us,p999_us,max_us,mean_us";
+
+void print_csv_header()
+{
+	std::printf("%s\n", RESULT_FIELDS);
+}
+
+void print_csv(const options &opts, const thread_stats &total)
+{
+	std::printf("%s,%zu,%zu,%zu,%zu,%.0f,%.1f,%zu,%zu,%.0f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+		opts.protocol.c_str(), opts.connections, opts.threads, opts.size, opts.pipeline, opts.rate,
+		opts.duration, total.completed, total.errors,
+		total.completed / opts.duration, total.bytes / opts.duration / 1e6,
+		total.latency.min() / 1e3, total.latency.percentile(50) / 1e3, total.latency.percentile(90) / 1e3,
+		total.latency.percentile(99) / 1e3, total.latency.percentile(99.9) / 1e3,
+		total.latency.max() / 1e3, total.latency.mean() / 1e3);
+}
+
+void print_json(const options &opts, const thread_stats &total)
+{
+	std::printf("{\"protocol\": \"%s\", \"connections\": %zu, \"threads\": %zu, \"size\": %zu, "
+				"\"pipeline\": %zu, \"rate\": %.0f, \"duration\": %.1f, \"completed\": %zu, \"errors\": %zu, "
+				"\"requests_per_sec\": %.0f, \"mb_per_sec\": %.3f, \"min_us\": %.1f, \"p50_us\": %.1f, "
+				"\"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, \"mean_us\": %.1f}\n",
+		opts.protocol.c_str(), opts.connections, opts.threads, opts.size, opts.pipeline, opts.rate,
+		opts.duration, total.completed, total.errors,
+		total.completed / opts.duration, total.bytes / opts.duration / 1e6,
+		total.latency.min() / 1e3, total.latency.percentile(50) / 1e3, total.latency.percentile(90) / 1e3,
+		total.latency.percentile(99) / 1e3, total.latency.percentile(99.9) / 1e3,
+		total.latency.max() / 1e3, total.latency.mean() / 1e3);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc == 2 && std::string(argv[1]) == "--csv-header")
+	{
+		print_csv_header();
+		return 0;
+	}
+
+	run_context context;
+	if (!parse_options(argc, argv, context.opts))
+	{
+		std::cerr << "Usage: load_generator [--host h] [--port p] [--protocol line|nul|daytime]\n"
+					 "       [--connections n] [--threads n] [--size bytes] [--pipeline n]\n"
+					 "       [--rate requests/s] [--duration s] [--warmup s] [--format text|csv|json]\n"
+					 "       load_generator --csv-header\n";
+		return 1;
+	}
+	const options &opts = context.opts;
+
+	try
+	{
+		boost::asio::io_service resolver_service;
+		tcp::resolver resolver(resolver_service);
+		context.endpoint = *resolver.resolve(tcp::resolver::query(opts.host, std::to_string(opts.port)));
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Error resolving " << opts.host << ": " << e.what() << std::endl;
+		return 1;
+	}
+
+	clock_type::time_point start = clock_type::now();
+	context.measure_from = start + std::chrono::duration_cast<clock_type::duration>(
+		std::chrono::duration<double>(opts.warmup));
+	context.stop_at = context.measure_from + std::chrono::duration_cast<clock_type::duration>(
+		std::chrono::duration<double>(opts.duration));
+
+	// one io_service per thread, connections dealt out round robin
+	std::vector<boost::shared_ptr<boost::asio::io_service> > services;
+	std::vector<thread_stats> stats(opts.threads);
+	for (size_t i = 0; i < opts.threads; i++)
+		services.push_back(boost::make_shared<boost::asio::io_service>());
+
+	for (size_t i = 0; i < opts.connections; i++)
+	{
+		size_t t = i % opts.threads;
+		if (opts.protocol == "daytime")
+			boost::make_shared<daytime_client>(boost::ref(*services[t]), boost::cref(context), boost::ref(stats[t]))->start();
+		else
+			boost::make_shared<stream_client>(boost::ref(*services[t]), boost::cref(context), boost::ref(stats[t]))->start();
+	}
+
+	boost::thread_group threads;
+	for (size_t i = 0; i < opts.threads; i++)
+		threads.create_thread(boost::bind(&boost::asio::io_service::run, services[i].get()));
+
+	// connections stop on their own at stop_at; give stragglers a moment, then cut them off
+	boost::this_thread::sleep_until(boost::chrono::steady_clock::now() +
+		boost::chrono::milliseconds(static_cast<long>((opts.warmup + opts.duration) * 1000) + 2000));
+	for (size_t i = 0; i < opts.threads; i++)
+		services[i]->stop();
+	threads.join_all();
+
+	thread_stats total;
+	for (size_t i = 0; i < opts.threads; i++)
+	{
+		total.latency.merge(stats[i].latency);
+		total.completed += stats[i].completed;
+		total.bytes += stats[i].bytes;
+		total.errors += stats[i].errors;
+	}
+
+	if (opts.format == "csv")
+		print_csv(opts, total);
+	else if (opts.format == "json")
+		print_json(opts, total);
+	else
+		print_text(opts, total);
+
+	return 0;
+}
@@ -1,20 +1,146 @@
 // Below code is for synchronous TCP client
 
 #include <iostream>
+#include <algorithm>
 #include <array>
 #include <boost/asio.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <vector>
+#include <poll.h>
+#include "../../common/resolver_cache.hpp"
 
 using boost::asio::ip::tcp;
 
+// every pipelined request is this long, '\n' included. The server echoes a line
+// back without its terminator and without a separator, so fixed-width requests
+// are what lets us cut the reply stream back into responses.
+const size_t REQUEST_SIZE = 32;
+const size_t RESPONSE_SIZE = REQUEST_SIZE - 1;
+
+/**
+ * request number "id": the id in decimal, padded to REQUEST_SIZE - 1 with '.'
+ */
+void make_request(unsigned long id, char *request)
+{
+	int digits = std::snprintf(request, REQUEST_SIZE, "%010lu", id);
+	std::memset(request + digits, '.', RESPONSE_SIZE - digits);
+	request[RESPONSE_SIZE] = '\n';
+}
+
+/**
+ * keeps up to "depth" requests in flight on "socket" until "requests" have been
+ * answered; responses come back in order, so the n-th RESPONSE_SIZE bytes
+ * received must match the n-th request.
+ *
+ * the window is refilled in one batch once the previous one is sent. The
+ * socket is non-blocking and sending and receiving are interleaved: with a
+ * deep window the server stops reading from us until we read its replies, so
+ * a blocking write of the whole batch would wait for it forever while it
+ * waits for us.
+ */
+int run_pipelined(tcp::socket &socket, unsigned int depth, unsigned long requests)
+{
+	std::vector<char> out(depth * REQUEST_SIZE);
+	size_t out_size = 0;					// bytes of the batch in "out"
+	size_t out_sent = 0;					// ... of which have been written
+	std::array<char, 65536> in;
+	char expected[REQUEST_SIZE];
+	char partial[RESPONSE_SIZE];			// a response split across reads
+	size_t partial_size = 0;
+
+	unsigned long sent = 0;
+	unsigned long answered = 0;
+	auto started = std::chrono::steady_clock::now();
+
+	socket.non_blocking(true);
+
+	while (answered < requests)
+	{
+		// top the window up once the last batch is out
+		if (out_sent == out_size)
+		{
+			out_size = out_sent = 0;
+			while (sent < requests && sent - answered < depth)
+			{
+				make_request(sent++, &out[out_size]);
+				out_size += REQUEST_SIZE;
+			}
+		}
+
+		boost::system::error_code error;
+		bool progress = false;
+		if (out_sent < out_size)
+		{
+			size_t written = socket.write_some(boost::asio::buffer(&out[out_sent], out_size - out_sent), error);
+			if (!error)
+			{
+				out_sent += written;
+				progress = true;
+			}
+			else if (error != boost::asio::error::would_block)
+				throw boost::system::system_error(error);
+		}
+
+		size_t len = socket.read_some(boost::asio::buffer(in), error);
+		if (error == boost::asio::error::would_block)
+			len = 0;
+		else if (error == boost::asio::error::eof)
+		{
+			std::cerr << "connection closed after " << answered << " responses\n";
+			return -2;
+		}
+		else if (error)
+			throw boost::system::system_error(error);
+		else
+			progress = true;
+
+		// neither direction moved: sleep until one can
+		if (!progress)
+		{
+			pollfd ready = { socket.native_handle(), short(POLLIN | (out_sent < out_size ? POLLOUT : 0)), 0 };
+			::poll(&ready, 1, -1);
+		}
+
+		for (size_t i = 0; i < len; )
+		{
+			size_t take = std::min(RESPONSE_SIZE - partial_size, len - i);
+			std::memcpy(partial + partial_size, &in[i], take);
+			partial_size += take;
+			i += take;
+
+			if (partial_size < RESPONSE_SIZE)
+				break;
+
+			make_request(answered, expected);
+			if (std::memcmp(partial, expected, RESPONSE_SIZE) != 0)
+			{
+				std::cerr << "response " << answered << " does not match its request\n";
+				return -3;
+			}
+			answered++;
+			partial_size = 0;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	std::cout << answered << " requests, depth " << depth << ", " << seconds << " s, "
+			  << answered / seconds << " requests/sec\n";
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
 	try
 	{
-		// user should specify the server ipaddress as the 2nd argument
-		if (argc != 2)
+		// user should specify the server ipaddress as the 2nd argument;
+		// a depth switches to pipelined mode with that many requests in flight
+		if (argc < 2 || argc > 4)
 		{
-			std::cerr << "Usage: client <ip-address>\n";
+			std::cerr << "Usage: client <ip-address> [depth [requests]]\n";
 			return 1;
 		}
 		
@@ -22,18 +148,19 @@ int main(int argc, char* argv[])
 		boost::asio::io_service io_service;
 
 		// convert the server name that was specified as a parameter to the application to a
-		// TCP end_point. To do this use an object of type boost::asio::ip::tcp::resolver.
-		tcp::resolver resolver(io_service);
+		// list of addresses. The resolver_cache asks boost::asio::ip::tcp::resolver at most once
+		// per name and TTL, and not at all for a numeric address such as 127.0.0.1.
+		resolver_cache dns(io_service);
 
-		// A resolver takes a query object and turns it into a list of endpoints.
-		// We construct a query using the name of the server, specified in argv[1]
-		// and the name of the service, in this case "daytime".
-		tcp::resolver::query query(argv[1], "11235");
+		boost::system::error_code resolve_error;
+		resolver_cache::addresses_ptr addresses = dns.resolve(argv[1], resolve_error);
+		if (resolve_error)
+			throw boost::system::system_error(resolve_error);
 		
-		// the list of endpoints is returned using an iterator of type 
-		// boost::asio::ip::tcp::resolver::iterator.
-		// a default constructed iterator object can be used as an end iterator.
-		tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
+		// the cache keeps addresses only, the port is ours to add
+		std::vector<tcp::endpoint> endpoints;
+		for (auto& address: *addresses)
+			endpoints.push_back(tcp::endpoint(address, 11235));
 
 		// now we create and connect the socket.
 		// the list of endpoints obtained above botjh contain IPv4 and IPv6 endpoints,
@@ -42,7 +169,14 @@ int main(int argc, char* argv[])
 		// boost::asio::connect() function does it for us automatically.
 		tcp::socket socket(io_service);
 	
-		connect(socket, endpoint_iterator);
+		boost::asio::connect(socket, endpoints.begin(), endpoints.end());
+
+		if (argc > 2)
+		{
+			unsigned int depth = std::max(1ul, std::strtoul(argv[2], nullptr, 10));
+			unsigned long requests = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100000;
+			return run_pipelined(socket, depth, requests);
+		}
 
 		// the connections is open. all we need to do now is read the response from the daytime 
 		// service.
@@ -0,0 +1,232 @@
+// Compares the thread-per-connection server (my_server) with the asynchronous
+// connection engine (my_async_server) on the same line echo workload.
+//
+// usage: connection_model_benchmark [connections] [lines-per-connection] [threads]
+//
+// Both servers run inside this process on their own port. "threads" is the size
+// of the async engine's pool and of the client's pool. Note that the thread-per-
+// connection model needs one thread (and stack) per client, so large connection
+// counts may fail there while the async engine keeps going.
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include "my_server.hpp"
+#include "my_async_server.hpp"
+
+using boost::asio::ip::tcp;
+
+// every request has the same width, the reply is the request without '\n'
+const size_t LINE_SIZE = 16;
+
+std::atomic<size_t> completed_clients(0);
+std::atomic<size_t> completed_lines(0);
+
+/**
+ * number of threads currently in this process (linux only, 0 elsewhere)
+ */
+size_t thread_count()
+{
+	std::ifstream status("/proc/self/status");
+	std::string key;
+	while (status >> key)
+	{
+		if (key == "Threads:")
+		{
+			size_t threads = 0;
+			status >> threads;
+			return threads;
+		}
+	}
+	return 0;
+}
+
+class bench_client : public boost::enable_shared_from_this<bench_client>
+{
+	public:
+		bench_client(boost::asio::io_service &io_service, size_t lines) :
+			socket(io_service),
+			lines_left(lines)
+		{}
+
+		void start(const tcp::endpoint &endpoint)
+		{
+			socket.async_connect(
+				endpoint,
+				boost::bind(&bench_client::handle_connect, shared_from_this(), boost::asio::placeholders::error)
+			);
+		}
+
+	private:
+		void handle_connect(const boost::system::error_code &error)
+		{
+			if (error)
+			{
+				std::fprintf(stderr, "connect failed: %s\n", error.message().c_str());
+				finish();
+				return;
+			}
+			send_line();
+		}
+
+		void send_line()
+		{
+			if (lines_left == 0)
+			{
+				finish();
+				return;
+			}
+
+			std::snprintf(request, sizeof(request), "line-%010zu\n", lines_left);
+			boost::asio::async_write(
+				socket,
+				boost::asio::buffer(request, LINE_SIZE),
+				boost::bind(&bench_client::handle_write, shared_from_this(), boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_write(const boost::system::error_code &error)
+		{
+			if (error)
+			{
+				finish();
+				return;
+			}
+			boost::asio::async_read(
+				socket,
+				boost::asio::buffer(reply, LINE_SIZE - 1),
+				boost::bind(&bench_client::handle_read, shared_from_this(), boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_read(const boost::system::error_code &error)
+		{
+			if (error)
+			{
+				std::fprintf(stderr, "read failed: %s\n", error.message().c_str());
+				finish();
+				return;
+			}
+			lines_left--;
+			completed_lines++;
+			send_line();
+		}
+
+		void finish()
+		{
+			boost::system::error_code ignored;
+			socket.close(ignored);
+			completed_clients++;
+		}
+
+		tcp::socket		socket;
+		size_t			lines_left;
+		char			request[32];
+		char			reply[LINE_SIZE];
+};
+
+/**
+ * drives "connections" clients against the server on "port" and prints one result row
+ */
+void run_clients(const char *model, unsigned short port, size_t connections, size_t lines, unsigned int threads)
+{
+	boost::asio::io_service io_service;
+	tcp::endpoint endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port);
+
+	completed_clients = 0;
+	completed_lines = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < connections; i++)
+		boost::make_shared<bench_client>(boost::ref(io_service), lines)->start(endpoint);
+
+	boost::thread_group pool;
+	for (unsigned int i = 0; i < threads; i++)
+		pool.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+
+	// sample the thread count while the clients are running
+	size_t peak_threads = 0;
+	while (completed_clients < connections)
+	{
+		peak_threads = std::max(peak_threads, thread_count());
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+	}
+	pool.join_all();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::printf("%-22s %8zu %10zu %9.3f %12.0f %12.1f %10zu\n",
+		model, connections, completed_lines.load(), seconds,
+		completed_lines / seconds, seconds * 1e6 * connections / std::max<size_t>(1, completed_lines),
+		peak_threads);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t connections = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000;
+	size_t lines = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100;
+	unsigned int threads = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+
+	// both servers trace every connection, read and write, which would
+	// dominate the numbers; errors below go straight to stderr instead
+	std::cout.rdbuf(nullptr);
+	std::cerr.rdbuf(nullptr);
+
+	// every connection costs two descriptors in this process
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	std::printf("%-22s %8s %10s %9s %12s %12s %10s\n",
+		"model", "conns", "lines", "seconds", "lines/s", "avg rtt us", "threads");
+
+	// thread-per-connection: one acceptor thread plus one worker() per client
+	{
+		boost::asio::io_service io_service;
+		my_server server(&io_service, tcp::endpoint(tcp::v4(), 11240));
+		if (server.failed)
+			return 1;
+
+		boost::asio::io_service::work work(io_service);
+		boost::thread acceptor_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+
+		run_clients("thread-per-connection", 11240, connections, lines, threads);
+
+		io_service.stop();
+		acceptor_thread.join();
+	}
+
+	// async engine: all connections on a fixed pool of "threads" threads
+	{
+		boost::asio::io_service io_service;
+		my_async_server server(&io_service, tcp::endpoint(tcp::v4(), 11241));
+		if (server.failed)
+			return 1;
+
+		boost::thread_group pool;
+		for (unsigned int i = 0; i < threads; i++)
+			pool.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+
+		run_clients("async-engine", 11241, connections, lines, threads);
+
+		io_service.stop();
+		pool.join_all();
+	}
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef LINE_SPLITTER_HPP
+#define LINE_SPLITTER_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * returns the first '\n', '\r' or '\0' in [begin, end), or end if there is none
+ *
+ * compares 32 (AVX2) or 16 (SSE2) bytes per step against all three delimiters
+ * and falls back to a byte loop for the tail and on other targets. The
+ * instruction set is picked at compile time (-mavx2 / -march=native).
+ */
+inline const char* find_line_delimiter(const char *begin, const char *end)
+{
+	const char *p = begin;
+
+#if defined(__AVX2__)
+	const __m256i nl32 = _mm256_set1_epi8('\n');
+	const __m256i cr32 = _mm256_set1_epi8('\r');
+	const __m256i nul32 = _mm256_setzero_si256();
+
+	for ( ; end - p >= 32; p += 32 )
+	{
+		__m256i chunk = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(p) );
+		__m256i hits = _mm256_or_si256(
+			_mm256_or_si256( _mm256_cmpeq_epi8(chunk, nl32), _mm256_cmpeq_epi8(chunk, cr32) ),
+			_mm256_cmpeq_epi8(chunk, nul32)
+		);
+		unsigned int mask = static_cast<unsigned int>( _mm256_movemask_epi8(hits) );
+		if ( mask )
+			return p + __builtin_ctz(mask);
+	}
+#endif
+
+#if defined(__SSE2__)
+	const __m128i nl16 = _mm_set1_epi8('\n');
+	const __m128i cr16 = _mm_set1_epi8('\r');
+	const __m128i nul16 = _mm_setzero_si128();
+
+	for ( ; end - p >= 16; p += 16 )
+	{
+		__m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i*>(p) );
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128( _mm_cmpeq_epi8(chunk, nl16), _mm_cmpeq_epi8(chunk, cr16) ),
+			_mm_cmpeq_epi8(chunk, nul16)
+		);
+		unsigned int mask = static_cast<unsigned int>( _mm_movemask_epi8(hits) );
+		if ( mask )
+			return p + __builtin_ctz(mask);
+	}
+#endif
+
+	for ( ; p < end; p++ )
+	{
+		if ( ( *p == '\n' ) || ( *p == '\r' ) || ( *p == '\0' ) )
+			return p;
+	}
+	return end;
+}
+
+/**
+ * splits received chunks into lines the way worker() does: a line ends at
+ * '\n' or '\r', runs of line ends produce no blank lines, and a '\0' ends the
+ * chunk (whatever follows it in that chunk is dropped).
+ *
+ * complete lines are handed out as (pointer, size) spans into the caller's
+ * buffer. Only a line that straddles two chunks is copied, into "partial".
+ */
+class line_splitter
+{
+	public:
+		/**
+		 * calls handler(const char *data, size_t size) for every complete line
+		 */
+		template <typename LineHandler>
+		void split(const char *begin, const char *end, LineHandler handler)
+		{
+			const char *pstart = begin;
+
+			while ( pstart < end )
+			{
+				const char *pchar = find_line_delimiter( pstart, end );
+
+				if ( ( pchar == end ) || ( *pchar == '\0' ) )
+				{
+					// keep the non-terminated text for the next chunk
+					partial.append( pstart, pchar - pstart );
+					return;
+				}
+
+				if ( partial.empty() )
+				{
+					if ( pchar > pstart )
+						handler( pstart, size_t(pchar - pstart) );
+				}
+				else
+				{
+					partial.append( pstart, pchar - pstart );
+					handler( partial.data(), partial.size() );
+					partial.clear();
+				}
+
+				// skip over newlines
+				while ( ( pchar < end ) && ( ( *pchar == '\n' ) || ( *pchar == '\r' ) ) )
+					pchar++;
+
+				pstart = pchar;
+			}
+		}
+
+		/**
+		 * bytes of an unterminated line carried over to the next chunk
+		 */
+		size_t pending() const
+		{
+			return partial.size();
+		}
+
+	private:
+		std::string partial;
+};
+
+#endif
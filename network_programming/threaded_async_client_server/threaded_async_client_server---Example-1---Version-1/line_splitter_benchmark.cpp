@@ -0,0 +1,162 @@
+// Microbenchmark: worker()'s original byte-at-a-time line loop against
+// line_splitter (find_line_delimiter() + spans into the receive buffer).
+//
+// usage: line_splitter_benchmark [megabytes]
+//
+// Build with -O2 for the SSE2 path or -O2 -mavx2 for the AVX2 path. Each
+// workload is a stream of "\r\n" or "\n" terminated lines whose lengths follow
+// a distribution seen in line protocols, fed to the splitter in reads of 1024
+// bytes (worker()'s buffer) and of 64KB.
+//
+// The two line counts differ slightly: the old loop did not end a carried-over
+// line when the next read started with its '\n', and glued it to the following
+// line. line_splitter ends it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include "line_splitter.hpp"
+
+/**
+ * the loop worker() used before line_splitter, kept verbatim apart from
+ * process_line() being replaced by a checksum
+ */
+class legacy_splitter
+{
+	public:
+		template <typename LineHandler>
+		void split(const char *acBuffer, const char *pend, LineHandler handler)
+		{
+			char const *pstart = acBuffer;
+			char const *pchar = pstart;
+
+			while ( ( pchar < pend ) && ( *pchar != '\0' ) )
+			{
+				if ( ( *pchar != '\n' ) && ( *pchar != '\r' ) )
+				{
+					pchar++;
+					continue;
+				}
+				// non-blank line detected?
+				if ( pchar > pstart )
+				{
+					line += std::string( pstart, pchar - pstart );
+					handler( line.data(), line.size() );
+					line = "";
+				}
+
+				// skip over newlines
+				while ( ( pchar < pend ) && ( ( *pchar == '\n' ) || ( *pchar == '\r' ) ) )
+					pchar++;
+
+				pstart = pchar;
+				continue;
+			}
+
+			if ( pchar > pstart )
+			{
+				// put remaining non-terminated text into line buffer
+				line += std::string( pstart, pchar - pstart );
+			}
+		}
+
+	private:
+		std::string line;
+};
+
+/**
+ * stands in for process_line(): touches the line so the work cannot be optimised away
+ */
+struct line_stats
+{
+	line_stats() : lines(0), checksum(0) {}
+
+	void operator()(const char *line, size_t size)
+	{
+		lines++;
+		checksum += size + static_cast<unsigned char>(line[size - 1]);
+	}
+
+	size_t lines;
+	size_t checksum;
+};
+
+/**
+ * "total" bytes of lines with lengths drawn from "length", a third of them "\r\n" terminated
+ */
+template <typename Distribution>
+std::string make_stream(size_t total, Distribution length)
+{
+	std::mt19937 rng(42);
+	std::string stream;
+	stream.reserve(total + 4096);
+
+	while (stream.size() < total)
+	{
+		double drawn = length(rng);
+		size_t size = drawn < 1 ? 1 : static_cast<size_t>(drawn);
+		stream.append(size, static_cast<char>('a' + rng() % 26));
+		stream += (rng() % 3 == 0) ? "\r\n" : "\n";
+	}
+	return stream;
+}
+
+template <typename Splitter>
+double run(const std::string &stream, size_t read_size, line_stats &stats)
+{
+	Splitter splitter;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (size_t offset = 0; offset < stream.size(); offset += read_size)
+	{
+		const char *begin = stream.data() + offset;
+		const char *end = stream.data() + std::min(stream.size(), offset + read_size);
+		splitter.split(begin, end, [&stats](const char *line, size_t size) { stats(line, size); });
+	}
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename Distribution>
+void compare(const char *name, size_t total, Distribution length)
+{
+	std::string stream = make_stream(total, length);
+	const size_t read_sizes[] = { 1024, 65536 };
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		line_stats legacy_stats, simd_stats;
+		double legacy = run<legacy_splitter>(stream, read_sizes[i], legacy_stats);
+		double simd = run<line_splitter>(stream, read_sizes[i], simd_stats);
+
+		std::printf("%-12s %6zu %10zu %10zu %10.1f %10.1f %8.2fx\n",
+			name, read_sizes[i], legacy_stats.lines, simd_stats.lines,
+			stream.size() / legacy / 1e6, stream.size() / simd / 1e6, legacy / simd);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t total = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256) << 20;
+
+#if defined(__AVX2__)
+	const char *isa = "AVX2";
+#elif defined(__SSE2__)
+	const char *isa = "SSE2";
+#else
+	const char *isa = "scalar";
+#endif
+	std::printf("find_line_delimiter: %s, %zu MB per workload\n", isa, total >> 20);
+	std::printf("%-12s %6s %10s %10s %10s %10s %9s\n",
+		"lines", "read", "loop lines", "simd lines", "loop MB/s", "simd MB/s", "speedup");
+
+	// short commands / chat lines, typical log lines, long records
+	compare("short ~16", total, std::exponential_distribution<double>(1.0 / 16));
+	compare("medium ~80", total, std::normal_distribution<double>(80, 30));
+	compare("long ~1000", total, std::lognormal_distribution<double>(6.9, 0.5));
+
+	return 0;
+}
@@ -1,53 +1,116 @@
 #include <iostream>
 #include <list>
+#include <utility>		// before Boost: asio/awaitable.hpp of 1.74 uses std::exchange without it
 #include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <cstdlib>
+#include <functional>
 #include <string>
-#include <utility>
 #include <istream>
 #include <ostream>
 #include "my_server.hpp"
+#include "my_async_server.hpp"
+#include "my_coro_server.hpp"
+#include "../../common/latency_recorder.hpp"
+#include "../../common/resolver_cache.hpp"
+#include "../../common/listener_handoff.hpp"
 
 const short PORT1 = 11235;
+
+// after a hot restart, how long the old process waits for its connections to end
+const int DRAIN_SECONDS = 30;
+
+// admission control of the threaded engine, see admission_control.hpp: every
+// connection costs a thread, a storm of them must not starve the live ones
+const size_t MAX_CONNECTIONS = 4096;
+const size_t MAX_CONNECTIONS_PER_ADDRESS = 1024;
+const double ACCEPT_RATE = 2000; // connections per second
+const double ACCEPT_BURST = 512;
 //const short PORT2 = 11236;
 //const short PORT3 = 11237;
 //const short PORT4 = 11238;
 //const short PORT5 = 11239;
 /**
  * hostname to ip address string (using DNS lookup)
+ *  goes through "dns", so listeners on the same host name cost one lookup
  */
-std::string get_ip_address(boost::asio::io_service &io_service, std::string hostname) 
+std::string get_ip_address(resolver_cache &dns, std::string hostname) 
 {
-    boost::asio::ip::tcp::resolver resolver(io_service);
-    boost::asio::ip::tcp::resolver::query query(hostname, "time"); // any port number will do
-    boost::asio::ip::tcp::resolver::iterator iterator;
-    try {
-        iterator = resolver.resolve(query);
-    } 
-		catch ( boost::system::system_error e ) 
+    boost::system::error_code error;
+    resolver_cache::addresses_ptr addresses = dns.resolve(hostname, error);
+    if ( error ) 
 		{
-        std::cerr << "Error resolving " << hostname << ": " << e.what() << std::endl;
+        std::cerr << "Error resolving " << hostname << ": " << error.message() << std::endl;
         return( "" );
     }
  
-    boost::asio::ip::tcp::resolver::iterator end;
-    if ( iterator == end )
+    if ( addresses->empty() )
         return("");
  
-    return(iterator->endpoint().address().to_string());
+    return(addresses->front().to_string());
 }
 
+/**
+ * how accepted connections are served
+ *  thread_per_connection: my_server, one worker() thread per socket
+ *  async_engine: my_async_server, handlers on a fixed pool of threads
+ *  coroutine_engine: my_coro_server, coro_worker() coroutines on that pool
+ *  (needs C++20 coroutines)
+ */
+enum connection_engine
+{
+    thread_per_connection,
+    async_engine,
+    coroutine_engine
+};
+
 /**
  * main I/O loop
  *  sets up the listening address(es) and runs I/O asynchronous service
+ *
+ *  with a handoff_path (hot restart, threaded engine only) the listeners of
+ *  the process serving that path are taken over instead of bound, and are
+ *  served on the path in turn; once a newer process has taken them, accepting
+ *  stops and the loop ends when the live connections are done
  */
-int do_input_output(std::list< std::pair<std::string, unsigned int> > listeners)
+int do_input_output(
+    std::list< std::pair<std::string, unsigned int> > listeners,
+    connection_engine engine = thread_per_connection,
+    unsigned int threads = 1,
+    const std::string &handoff_path = ""
+)
 {
     // create I/O service
     boost::asio::io_service io_service;
+    resolver_cache dns( io_service );
+ 
+    boost::scoped_ptr<listener_handoff_client> predecessor;
+    std::vector<int> adopted;
+    if ( !handoff_path.empty() )
+    {
+        if ( engine != thread_per_connection )
+        {
+            std::cerr << "hot restart needs the threaded engine" << std::endl;
+            return( 1 );
+        }
+ 
+        predecessor.reset( new listener_handoff_client( handoff_path ) );
+        adopted = predecessor->descriptors();
+        if ( !adopted.empty() && adopted.size() != listeners.size() )
+        {
+            std::cerr << "previous process has " << adopted.size() << " listeners, we need " << listeners.size() << std::endl;
+            return( 1 );
+        }
+    }
  
     // start a server for each listen address
     std::list< boost::shared_ptr<my_server> > servers; // track in a list
+    std::list< boost::shared_ptr<my_async_server> > async_servers;
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    std::list< boost::shared_ptr<my_coro_server> > coro_servers;
+#endif
     for (
         std::list< std::pair<std::string, unsigned int> >::iterator it = listeners.begin();
         it != listeners.end();
@@ -61,7 +124,7 @@ int do_input_output(std::list< std::pair<std::string, unsigned int> > listeners)
         boost::asio::ip::tcp::endpoint endpoint;
         if (! hostname.empty()) 
 				{
-            std::string address = get_ip_address(io_service, hostname);
+            std::string address = get_ip_address(dns, hostname);
             if ( address.empty() ) 
 						{
                 std::cerr << "could not resolve " << hostname << std::endl;
@@ -82,29 +145,127 @@ int do_input_output(std::list< std::pair<std::string, unsigned int> > listeners)
         }
  
         // create server
-        boost::shared_ptr<my_server> server(
-            new my_server( &io_service, endpoint )
-        );
+        bool failed;
+        if ( engine == async_engine )
+        {
+            boost::shared_ptr<my_async_server> server(
+                new my_async_server( &io_service, endpoint )
+            );
+            failed = server->failed;
+            async_servers.push_back( server );
+        }
+        else if ( engine == coroutine_engine )
+        {
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+            boost::shared_ptr<my_coro_server> server(
+                new my_coro_server( &io_service, endpoint )
+            );
+            failed = server->failed;
+            coro_servers.push_back( server );
+#else
+            std::cerr << "the coroutine engine needs C++20 coroutines" << std::endl;
+            return( 1 );
+#endif
+        }
+        else
+        {
+            admission_limits limits;
+            limits.max_connections = MAX_CONNECTIONS;
+            limits.max_per_address = MAX_CONNECTIONS_PER_ADDRESS;
+            limits.accept_rate = ACCEPT_RATE;
+            limits.accept_burst = ACCEPT_BURST;
+
+            int listener = adopted.empty() ? -1 : adopted[servers.size()];
+            boost::shared_ptr<my_server> server(
+                new my_server( &io_service, endpoint, listener, DEFAULT_PENDING_ACCEPTS, limits )
+            );
+            failed = server->failed;
+            servers.push_back( server );
+        }
  
-        if ( server->failed ) 
+        if ( failed ) 
 				{
             std::cerr << "Failure in creatig server" << std::endl;
             return( 1 );
         }
-        servers.push_back( server );
  
         std::cout << "listen on \"" << endpoint << "\"" << std::endl;
     } // for each listener
  
+    // hand our listeners to the next process when it asks for them, then
+    // stop accepting and wait for the live connections to finish
+    boost::asio::steady_timer drain_timer( io_service );
+    std::chrono::steady_clock::time_point drain_deadline;
+    std::function<void (const boost::system::error_code&)> check_drained;
+    boost::scoped_ptr<listener_handoff_server> successor;
+    if ( predecessor )
+    {
+        predecessor->acknowledge(); // the old process stops accepting now
+ 
+        check_drained = [&]( const boost::system::error_code& )
+        {
+            size_t live = 0;
+            for ( auto &server: servers )
+                live += server->live_connections();
+ 
+            if ( live == 0 || std::chrono::steady_clock::now() >= drain_deadline )
+            {
+                io_service.stop();
+                return;
+            }
+ 
+            drain_timer.expires_from_now( std::chrono::milliseconds( 100 ) );
+            drain_timer.async_wait( check_drained );
+        };
+ 
+        std::vector<int> fds;
+        for ( auto &server: servers )
+            fds.push_back( server->listener() );
+ 
+        successor.reset( new listener_handoff_server( io_service, handoff_path, fds,
+            [&]()
+            {
+                std::cerr << "Handed off, draining connections" << std::endl;
+                for ( auto &server: servers )
+                    server->stop_accepting();
+ 
+                drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds( DRAIN_SECONDS );
+                check_drained( boost::system::error_code() );
+            }
+        ) );
+    }
+ 
+    // print the server's latency histograms every 10 seconds
+    periodic_latency_dump latency_dump( io_service, std::chrono::seconds( 10 ), std::cerr );
+ 
     // now start the I/O service
     // can only stop by calling io_service.stop()
+    // the async and coroutine engines serve every connection from this pool of threads
+    boost::thread_group pool;
+    for ( unsigned int i = 1; i < threads; i++ )
+        pool.create_thread( boost::bind( &boost::asio::io_service::run, &io_service ) );
+
     io_service.run();
+    pool.join_all();
  
     return( 0 ); // everything went okay
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+	// usage: server [threaded|async|coro] [threads] [handoff-path]
+	connection_engine engine = thread_per_connection;
+	if (argc > 1 && std::string(argv[1]) == "async")
+		engine = async_engine;
+	else if (argc > 1 && std::string(argv[1]) == "coro")
+		engine = coroutine_engine;
+	
+	unsigned int threads = 1;
+	if (argc > 2)
+		threads = std::strtoul(argv[2], nullptr, 10);
+	if (threads == 0)
+		threads = std::max(1u, boost::thread::hardware_concurrency());
+	
 	std::pair<std::string, unsigned int> pair1("127.0.0.1", PORT1);
 	//std::pair<std::string, unsigned int> pair2("127.0.0.1", PORT2);
 	//std::pair<std::string, unsigned int> pair3("127.0.0.1", PORT3);
@@ -118,7 +279,9 @@ int main()
 //	listeners.push_back(pair4);
 //	listeners.push_back(pair5);
 	
-	int retVal = do_input_output(listeners);
+	std::string handoff_path = argc > 3 ? argv[3] : "";
+	
+	int retVal = do_input_output(listeners, engine, threads, handoff_path);
 	
 	return retVal;
 }
\ No newline at end of file
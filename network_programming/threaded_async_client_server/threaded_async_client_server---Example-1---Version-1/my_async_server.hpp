@@ -0,0 +1,323 @@
+#ifndef MY_ASYNC_SERVER_HPP
+#define MY_ASYNC_SERVER_HPP
+
+#include <boost/array.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "line_splitter.hpp"
+#include "timer_wheel.hpp"
+#include "../../common/latency_recorder.hpp"
+
+/**
+ * asynchronous counterpart of my_connection + worker()
+ *
+ * no thread is created per connection: every accepted socket is driven by
+ * handlers on the shared io_service, so a small fixed pool of threads calling
+ * io_service::run() can serve any number of connections. The strand keeps the
+ * handlers of one connection from running concurrently.
+ *
+ * reads and writes may carry a deadline; a zero timeout means none. The
+ * deadlines live on the server's timer_wheel, so arming and cancelling one
+ * per operation costs O(1).
+ */
+class my_async_connection : public boost::enable_shared_from_this<my_async_connection>
+{
+	public:
+		my_async_connection(
+				boost::asio::io_service &io_service,
+				timer_wheel &wheel,
+				std::chrono::milliseconds read_timeout = std::chrono::milliseconds(0),
+				std::chrono::milliseconds write_timeout = std::chrono::milliseconds(0)
+		) :
+			strand(io_service),
+			socket(io_service),
+			deadline(wheel, strand, socket),
+			read_timeout(read_timeout),
+			write_timeout(write_timeout),
+			first_read(true)
+		{}
+
+		void start()
+		{
+			accepted_at = latency_recorder::clock_type::now();
+
+			strand.dispatch(
+				boost::bind(&my_async_connection::do_read, shared_from_this())
+			);
+		}
+
+		/**
+		 * may be called from any thread
+		 */
+		void close()
+		{
+			strand.post(
+				boost::bind(&my_async_connection::do_close, shared_from_this())
+			);
+		}
+
+		boost::asio::io_service::strand		strand;
+		boost::asio::ip::tcp::socket		socket;
+		boost::asio::ip::tcp::endpoint		endpoint;
+
+	private:
+		void do_read()
+		{
+			if (read_timeout.count() > 0)
+			{
+				async_read_some_with_deadline(
+					socket,
+					strand,
+					deadline,
+					boost::asio::buffer(read_buffer),
+					read_timeout,
+					shared_from_this(),
+					boost::bind(
+						&my_async_connection::handle_read,
+						shared_from_this(),
+						boost::asio::placeholders::error,
+						boost::asio::placeholders::bytes_transferred
+					)
+				);
+				return;
+			}
+
+			socket.async_read_some(
+				boost::asio::buffer(read_buffer),
+				strand.wrap(
+					boost::bind(
+						&my_async_connection::handle_read,
+						shared_from_this(),
+						boost::asio::placeholders::error,
+						boost::asio::placeholders::bytes_transferred
+					)
+				)
+			);
+		}
+
+		void handle_read(const boost::system::error_code &error, size_t bytes_read)
+		{
+			if (error)
+			{
+				do_close();
+				return;
+			}
+
+			latency_recorder &latencies = latency_recorder::instance();
+			latency_recorder::clock_type::time_point read_at = latency_recorder::clock_type::now();
+			if (first_read)
+			{
+				latencies.record(accept_to_first_byte, read_at - accepted_at);
+				first_read = false;
+			}
+
+			// same splitting rules as worker(): lines end at '\n' or '\r',
+			// blank lines are skipped and a '\0' ends the received chunk
+			lines.split(
+				read_buffer.data(),
+				read_buffer.data() + bytes_read,
+				[this, &latencies, read_at](const char *line, size_t size)
+				{
+					latencies.record_since(read_to_handler, read_at);
+					process_line(line, size);
+				}
+			);
+
+			if (output.empty())
+			{
+				do_read();
+				return;
+			}
+
+			output_queued_at = latency_recorder::clock_type::now();
+			do_write();
+		}
+
+		void do_write()
+		{
+			// reading resumes only once the replies went out, so a slow
+			// reader cannot make the output grow without bound
+			if (write_timeout.count() > 0)
+			{
+				async_write_with_deadline(
+					socket,
+					strand,
+					deadline,
+					boost::asio::buffer(output),
+					write_timeout,
+					shared_from_this(),
+					boost::bind(
+						&my_async_connection::handle_write,
+						shared_from_this(),
+						boost::asio::placeholders::error
+					)
+				);
+				return;
+			}
+
+			boost::asio::async_write(
+				socket,
+				boost::asio::buffer(output),
+				strand.wrap(
+					boost::bind(
+						&my_async_connection::handle_write,
+						shared_from_this(),
+						boost::asio::placeholders::error
+					)
+				)
+			);
+		}
+
+		void handle_write(const boost::system::error_code &error)
+		{
+			output.clear();
+
+			if (error)
+			{
+				do_close();
+				return;
+			}
+
+			latency_recorder::instance().record_since(handler_to_write_complete, output_queued_at);
+			do_read();
+		}
+
+		/**
+		 * same contract as the free process_line(): the line is sent back
+		 * to the peer without its terminator
+		 */
+		void process_line(const char *line, size_t size)
+		{
+			output.append(line, size);
+		}
+
+		void do_close()
+		{
+			boost::system::error_code ignored;
+			socket.close(ignored);
+		}
+
+		socket_deadline				deadline;
+		std::chrono::milliseconds	read_timeout;
+		std::chrono::milliseconds	write_timeout;
+		boost::array<char, 1024>	read_buffer;
+		line_splitter				lines;
+		std::string					output;
+		bool						first_read;
+		latency_recorder::clock_type::time_point	accepted_at;
+		latency_recorder::clock_type::time_point	output_queued_at;
+};
+
+/**
+ * how long accepting pauses after running out of descriptors or buffers
+ */
+const std::chrono::milliseconds ACCEPT_RETRY_DELAY(100);
+
+class my_async_server
+{
+	public:
+		my_async_server(
+				boost::asio::io_service* io_service,
+				const boost::asio::ip::tcp::endpoint& endpoint,
+				std::chrono::milliseconds read_timeout = std::chrono::milliseconds(0),
+				std::chrono::milliseconds write_timeout = std::chrono::seconds(30)
+		) :
+			io_service(io_service),
+			acceptor(*io_service),
+			accept_timer(*io_service),
+			wheel(*io_service),
+			read_timeout(read_timeout),
+			write_timeout(write_timeout)
+		{
+			this->failed = false; // indicator whether construction failed
+
+			try {
+				this->acceptor.open(endpoint.protocol());
+				this->acceptor.set_option(
+									boost::asio::ip::tcp::acceptor::reuse_address(true)
+								);
+				this->acceptor.bind(endpoint);
+				this->acceptor.listen();
+			}
+			catch (const boost::system::system_error& e) {
+				std::cerr << "Error binding to " << endpoint.address().to_string() << ":" << endpoint.port() << ": " << e.what() << std::endl;
+				this->failed = true;
+				return;
+			}
+
+			start_accept();
+		}
+
+		void handle_accept(
+				boost::shared_ptr<my_async_connection> connection,
+				const boost::system::error_code& error
+		)
+		{
+			if ( error ) {
+				// the acceptor was closed: the server is going away
+				if ( error == boost::asio::error::operation_aborted )
+					return;
+
+				// the live connections carry on, and so does accepting; out of
+				// descriptors or buffers, give closing connections time to
+				// free some first
+				std::cerr << "Acceptor failed: " << error.message() << std::endl;
+				if ( error == boost::asio::error::no_descriptors
+					|| error == boost::system::errc::too_many_files_open_in_system
+					|| error == boost::asio::error::no_buffer_space )
+				{
+					accept_timer.expires_from_now(ACCEPT_RETRY_DELAY);
+					accept_timer.async_wait(
+						[this](const boost::system::error_code &timer_error)
+						{
+							if ( !timer_error )
+								start_accept();
+						}
+					);
+					return;
+				}
+
+				start_accept();
+				return;
+			}
+
+			connection->start();
+
+			start_accept();
+		}
+
+		bool failed;
+
+	private:
+		void start_accept()
+		{
+			boost::shared_ptr<my_async_connection> connection(
+				new my_async_connection(*this->io_service, wheel, read_timeout, write_timeout)
+			);
+			this->acceptor.async_accept(
+				connection->socket,
+				connection->endpoint,
+				boost::bind(
+					&my_async_server::handle_accept,
+					this,
+					connection,
+					boost::asio::placeholders::error
+				)
+			);
+		}
+
+		boost::asio::io_service				*io_service;
+		boost::asio::ip::tcp::acceptor		acceptor;
+		boost::asio::steady_timer			accept_timer;		// backoff after EMFILE and the like
+		timer_wheel							wheel;		// deadlines of all connections
+		std::chrono::milliseconds			read_timeout;
+		std::chrono::milliseconds			write_timeout;
+};
+
+#endif
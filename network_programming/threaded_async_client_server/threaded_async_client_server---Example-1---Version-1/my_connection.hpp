@@ -1,12 +1,15 @@
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <chrono>
+#include <string>
 
 class my_connection {
   public:
     my_connection() // constructor
 		{
 			close = false;
+			output_sent = 0;
 			// create new socket into which to receive the new connection
 			this->socket = boost::shared_ptr<boost::asio::ip::tcp::socket>(
 											new boost::asio::ip::tcp::socket(this->io_service)
@@ -20,15 +23,27 @@ class my_connection {
     boost::shared_ptr<boost::asio::ip::tcp::socket> socket;
     boost::asio::ip::tcp::endpoint endpoint;
  
-    // keep track of the thread for this connection
-    boost::shared_ptr<boost::thread> thread;
- 
     // keep track of the acceptor io_service so we can call stop() on it!
     boost::asio::io_service *master_io_service;
  
     // boolean to indicate a desire to kill this connection
     bool close;
  
+    // when the acceptor handed us the socket, for the latency histograms
+    std::chrono::steady_clock::time_point accepted_at;
+ 
+    // replies not yet sent in full: output[output_sent...] is still to go
+    std::string output;
+    size_t output_sent;
+ 
+    // when output last went from empty to non-empty
+    std::chrono::steady_clock::time_point output_queued_at;
+ 
+    size_t output_backlog() const
+    {
+        return output.size() - output_sent;
+    }
+ 
     // NOTE: you can add other variables here that store connection-specific
     // data, such as received HTML headers, or logged in username, or whatever
     // else you want to keep track of over a connection
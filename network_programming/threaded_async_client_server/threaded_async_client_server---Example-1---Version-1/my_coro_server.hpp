@@ -0,0 +1,265 @@
+#ifndef MY_CORO_SERVER_HPP
+#define MY_CORO_SERVER_HPP
+
+#include <utility>		// before Boost: asio/awaitable.hpp of 1.74 uses std::exchange without it
+#include <boost/asio.hpp>
+
+// C++20 coroutines: g++ 10+ / clang with -std=c++20, Boost 1.70+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "line_splitter.hpp"
+#include "my_async_server.hpp"
+#include "../../common/latency_recorder.hpp"
+
+/**
+ * runs "operation" (one async operation on "socket", started with the
+ * completion token it is given) with a deadline "timeout" from now; a zero
+ * timeout means none. On expiry the operation is cancelled and "error" is
+ * timed_out; whatever it transferred until then is returned.
+ *
+ * the timer's handler and the coroutine's resumption both run on the
+ * socket's executor, which must be a strand (or an io_service run by one
+ * thread), so they never run concurrently. That settles the race between the
+ * two once: the timer only cancels the socket while the operation is still
+ * pending, and timed_out is only reported for an operation that really was
+ * cancelled by the timer, not for one that completed just before it fired.
+ */
+template <class Operation>
+boost::asio::awaitable<size_t> with_timeout(
+		boost::asio::ip::tcp::socket &socket,
+		std::chrono::steady_clock::duration timeout,
+		boost::system::error_code &error,
+		Operation operation
+)
+{
+	auto token = boost::asio::redirect_error(boost::asio::use_awaitable, error);
+
+	if (timeout == std::chrono::steady_clock::duration::zero())
+		co_return co_await operation(token);
+
+	// shared with the timer's handler, which may run after we returned
+	struct race
+	{
+		bool	completed = false;
+		bool	expired = false;
+	};
+	std::shared_ptr<race> state = std::make_shared<race>();
+
+	boost::asio::steady_timer timer(socket.get_executor(), timeout);
+	timer.async_wait(
+		[state, &socket](const boost::system::error_code &timer_error)
+		{
+			// the socket is only touched while the operation is pending,
+			// and so while the coroutine, which owns the socket, is alive
+			if (timer_error || state->completed)
+				return;
+
+			state->expired = true;
+			boost::system::error_code ignored;
+			socket.cancel(ignored);
+		}
+	);
+
+	size_t transferred = co_await operation(token);
+	state->completed = true;
+	timer.cancel();
+
+	if (error == boost::asio::error::operation_aborted && state->expired)
+		error = boost::asio::error::timed_out;
+	co_return transferred;
+}
+
+/**
+ * async_read_some() with a deadline: some bytes, or timed_out
+ */
+template <class MutableBuffers>
+boost::asio::awaitable<size_t> async_read_some_for(
+		boost::asio::ip::tcp::socket &socket,
+		const MutableBuffers &buffers,
+		std::chrono::steady_clock::duration timeout,
+		boost::system::error_code &error
+)
+{
+	co_return co_await with_timeout(socket, timeout, error,
+		[&socket, &buffers](auto token) { return socket.async_read_some(buffers, token); });
+}
+
+/**
+ * async_write() with a deadline: all of "buffers", or an error and how much
+ * of them went out
+ */
+template <class ConstBuffers>
+boost::asio::awaitable<size_t> async_write_for(
+		boost::asio::ip::tcp::socket &socket,
+		const ConstBuffers &buffers,
+		std::chrono::steady_clock::duration timeout,
+		boost::system::error_code &error
+)
+{
+	co_return co_await with_timeout(socket, timeout, error,
+		[&socket, &buffers](auto token) { return boost::asio::async_write(socket, buffers, token); });
+}
+
+/**
+ * worker() written as a coroutine: serves one connection until it is closed,
+ * echoing every line without its terminator (process_line()'s contract)
+ *
+ * the code reads top to bottom like worker(), but every co_await gives the
+ * thread back to the io_service: no thread and no io_service per connection.
+ * A reply is written before the next read, so a peer that does not read its
+ * replies stops being read from (TCP flow control does the rest).
+ */
+boost::asio::awaitable<void> coro_worker(
+		boost::asio::ip::tcp::socket socket,
+		latency_recorder::clock_type::time_point accepted_at,
+		std::chrono::steady_clock::duration read_timeout,
+		std::chrono::steady_clock::duration write_timeout
+)
+{
+	char acBuffer[1024];
+	line_splitter lines;
+	std::string output;
+	bool first_read = true;
+	latency_recorder &latencies = latency_recorder::instance();
+
+	for (;;)
+	{
+		boost::system::error_code error;
+		size_t bytes_read = co_await async_read_some_for(socket, boost::asio::buffer(acBuffer), read_timeout, error);
+		if (error)
+			break;		// connection error, close or idle too long
+
+		latency_recorder::clock_type::time_point read_at = latency_recorder::clock_type::now();
+		if (first_read)
+		{
+			latencies.record(accept_to_first_byte, read_at - accepted_at);
+			first_read = false;
+		}
+
+		lines.split(
+			acBuffer,
+			acBuffer + bytes_read,
+			[&output, &latencies, read_at](const char *line, size_t size)
+			{
+				latencies.record_since(read_to_handler, read_at);
+				output.append(line, size);
+			}
+		);
+
+		if (output.empty())
+			continue;
+
+		latency_recorder::clock_type::time_point queued_at = latency_recorder::clock_type::now();
+		co_await async_write_for(socket, boost::asio::buffer(output), write_timeout, error);
+		if (error)
+			break;
+
+		latencies.record_since(handler_to_write_complete, queued_at);
+		output.clear();
+	}
+
+	boost::system::error_code ignored;
+	socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+}
+
+/**
+ * accepts connections and runs a coro_worker() for each, on a strand of its
+ * own; any number of threads may run the io_service
+ *
+ * timeouts as in my_async_server: a zero read timeout means none
+ */
+class my_coro_server
+{
+	public:
+		my_coro_server(
+				boost::asio::io_service* io_service,
+				const boost::asio::ip::tcp::endpoint& endpoint,
+				std::chrono::steady_clock::duration read_timeout = std::chrono::steady_clock::duration::zero(),
+				std::chrono::steady_clock::duration write_timeout = std::chrono::seconds(30)
+		) :
+			io_service(io_service),
+			acceptor(*io_service),
+			read_timeout(read_timeout),
+			write_timeout(write_timeout)
+		{
+			this->failed = false; // indicator whether construction failed
+
+			try {
+				this->acceptor.open(endpoint.protocol());
+				this->acceptor.set_option(
+									boost::asio::ip::tcp::acceptor::reuse_address(true)
+								);
+				this->acceptor.bind(endpoint);
+				this->acceptor.listen();
+			}
+			catch (const boost::system::system_error& e) {
+				std::cerr << "Error binding to " << endpoint.address().to_string() << ":" << endpoint.port() << ": " << e.what() << std::endl;
+				this->failed = true;
+				return;
+			}
+
+			boost::asio::co_spawn(*io_service, accept_loop(), boost::asio::detached);
+		}
+
+		bool failed;
+
+	private:
+		boost::asio::awaitable<void> accept_loop()
+		{
+			for (;;)
+			{
+				boost::asio::ip::tcp::socket socket(boost::asio::make_strand(*this->io_service));
+				boost::asio::ip::tcp::endpoint endpoint;
+				boost::system::error_code error;
+
+				co_await this->acceptor.async_accept(
+					socket,
+					endpoint,
+					boost::asio::redirect_error(boost::asio::use_awaitable, error)
+				);
+				if ( error ) {
+					// the acceptor was closed: the server is going away
+					if ( error == boost::asio::error::operation_aborted || !this->acceptor.is_open() )
+						co_return;
+
+					// the live connections carry on, and so does accepting; out of
+					// descriptors or buffers, give closing connections time to
+					// free some first (as my_async_server does)
+					std::cerr << "Acceptor failed: " << error.message() << std::endl;
+					if ( error == boost::asio::error::no_descriptors
+						|| error == boost::system::errc::too_many_files_open_in_system
+						|| error == boost::asio::error::no_buffer_space )
+					{
+						boost::asio::steady_timer backoff(*this->io_service, ACCEPT_RETRY_DELAY);
+						co_await backoff.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, error));
+					}
+					continue;
+				}
+
+				auto executor = socket.get_executor();
+				boost::asio::co_spawn(
+					executor,
+					coro_worker(std::move(socket), latency_recorder::clock_type::now(), read_timeout, write_timeout),
+					boost::asio::detached
+				);
+			}
+		}
+
+		boost::asio::io_service						*io_service;
+		boost::asio::ip::tcp::acceptor				acceptor;
+		std::chrono::steady_clock::duration			read_timeout;
+		std::chrono::steady_clock::duration			write_timeout;
+};
+
+#endif // BOOST_ASIO_HAS_CO_AWAIT
+
+#endif
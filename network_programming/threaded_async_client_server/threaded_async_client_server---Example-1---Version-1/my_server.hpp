@@ -1,8 +1,26 @@
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <boost/version.hpp>
+#include <atomic>
 #include "my_connection.hpp"
+#include "line_splitter.hpp"
+#include "../../common/admission_control.hpp"
+#include "../../common/latency_recorder.hpp"
+
+/**
+ * the io_service a socket runs on; newer Boost dropped get_io_service()
+ */
+boost::asio::io_service &socket_io_service(boost::asio::ip::tcp::socket &socket)
+{
+#if BOOST_VERSION >= 107000
+    return static_cast<boost::asio::io_service&>( socket.get_executor().context() );
+#else
+    return socket.get_io_service();
+#endif
+}
 
 /**
  * helper function
@@ -30,256 +48,255 @@ void set_bytes_result(
 }
  
 /**
- * emulate synchronous read with a timeout on socket
+ * outcome of wait_for_io(): bytes read and written, -1 on error or close
+ */
+struct io_result
+{
+    ssize_t read;
+    ssize_t written;
+};
+
+/**
+ * waits up to "seconds" for the socket to deliver data and/or to take some
+ * of "out", whichever comes first
  *
- * returns -1 on error or socket close, 0 on timeout, or bytes received
+ * a write may complete partially and reports how much went out, so the caller
+ * resumes right after it instead of rewriting the whole buffer. Once one
+ * operation finished the others are cancelled, but whatever they transferred
+ * meanwhile is still reported.
  */
-ssize_t read_with_timeout(
+io_result wait_for_io(
     boost::asio::ip::tcp::socket &socket,
-    void *buf,
-    size_t count,
+    void *in,
+    size_t in_size,
+    bool want_read,
+    const char *out,
+    size_t out_size,
     int seconds
-) 
+)
 {
-		std::cout << "______________read_with_timeout(...)______________\n";
-		
     boost::optional<boost::system::error_code> timer_result;
     boost::optional<boost::system::error_code> read_result;
-    size_t bytes_transferred;
- 
-    // set up a timer on the io_service for this socket
-    boost::asio::deadline_timer timer( socket.get_io_service() );
+    boost::optional<boost::system::error_code> write_result;
+    size_t bytes_read = 0;
+    size_t bytes_written = 0;
+
+    boost::asio::deadline_timer timer( socket_io_service( socket ) );
     timer.expires_from_now( boost::posix_time::seconds( seconds ) );
     timer.async_wait(
-        boost::bind(
-            set_result,
-            &timer_result,
-            boost::asio::placeholders::error
-        )
-    );
- 
-    // set up asynchronous read (respond when ANY data is received)
-    boost::asio::async_read(
-        socket,
-        boost::asio::buffer( (char *)buf, count ),
-        boost::asio::transfer_at_least( 1 ),
-        boost::bind(
-            set_bytes_result,
-            &read_result,
-            &bytes_transferred,
-            boost::asio::placeholders::error,
-            boost::asio::placeholders::bytes_transferred
-        )
+        boost::bind( set_result, &timer_result, boost::asio::placeholders::error )
     );
- 
-    socket.get_io_service().reset();
- 
-    // set default result to zero (timeout) because another thread
-    // may call io_service().stop() deliberately to interrupt the
-    // the read (say, if it wanted to signal the thread that there
-    // was data to write)
-    ssize_t result = 0;
-    bool resultset = false;
-    while ( socket.get_io_service().run_one() ) 
-		{
-        if ( read_result ) 
-				{
-            //boost::system::error_code e = (*read_result);
-            //std::cerr << "read_result was " << e.message() << std::endl;
-            timer.cancel();
-            if ( resultset == false ) 
-						{
-                result = ( bytes_transferred <= 0 ) ? -1 : bytes_transferred;
-                resultset = true;
-            }
-            read_result.reset();
-        } 
-				else if ( timer_result ) 
-				{
-            socket.cancel();
-            if ( resultset == false ) 
-						{
-                result = 0;
-                resultset = 0;
-            }
-            timer_result.reset();
-        }
+
+    if ( want_read )
+        socket.async_read_some(
+            boost::asio::buffer( (char *)in, in_size ),
+            boost::bind(
+                set_bytes_result,
+                &read_result,
+                &bytes_read,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred
+            )
+        );
+
+    if ( out_size > 0 )
+        socket.async_write_some(
+            boost::asio::buffer( out, out_size ),
+            boost::bind(
+                set_bytes_result,
+                &write_result,
+                &bytes_written,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred
+            )
+        );
+
+    socket_io_service( socket ).reset();
+
+    // wait for the first of the three...
+    while ( !timer_result && !read_result && !write_result && socket_io_service( socket ).run_one() )
+        ;
+
+    // ...then stop the others and let their handlers run
+    boost::system::error_code ignored;
+    timer.cancel( ignored );
+    socket.cancel( ignored );
+    while ( socket_io_service( socket ).run_one() )
+        ;
+
+    io_result result = { 0, 0 };
+    if ( read_result )
+    {
+        if ( !*read_result )
+            result.read = bytes_read;
+        else if ( *read_result != boost::asio::error::operation_aborted )
+            result.read = -1;
+    }
+    if ( write_result )
+    {
+        if ( !*write_result )
+            result.written = bytes_written;
+        else if ( *write_result != boost::asio::error::operation_aborted )
+            result.written = -1;
     }
- 
     return( result );
-}               
+}
 
-ssize_t write_with_timeout(
-    boost::asio::ip::tcp::socket &socket,
-    void const *buf,
-    size_t count,
-    int seconds
-) 
+/**
+ * unsent bytes per connection above which we stop reading from the peer,
+ * and below which we start again
+ */
+const size_t OUTPUT_HIGH_WATERMARK = 64 * 1024;
+const size_t OUTPUT_LOW_WATERMARK = 16 * 1024;
+
+/**
+ * async_accept operations my_server keeps outstanding by default, and the
+ * most connections it takes per wakeup with non-blocking accepts
+ */
+const size_t DEFAULT_PENDING_ACCEPTS = 4;
+const size_t ACCEPT_BATCH = 64;
+
+/**
+ * how long an accept waits before it is re-armed after running out of
+ * descriptors or buffers (my_async_server's ACCEPT_RETRY_DELAY)
+ */
+const std::chrono::milliseconds ACCEPT_BACKOFF(100);
+
+/**
+ * queues the line to be sent back to the peer; worker() writes it out
+ */
+void process_line(boost::shared_ptr<my_connection> connection, const char *line, size_t size)
 {
-    boost::optional<boost::system::error_code> timer_result;
-    boost::optional<boost::system::error_code> write_result;
-    size_t bytes_transferred;
- 
-    boost::asio::deadline_timer timer( socket.get_io_service() );
-    timer.expires_from_now( boost::posix_time::seconds( seconds ) );
-    timer.async_wait(
-        boost::bind(
-            set_result,
-            &timer_result,
-            boost::asio::placeholders::error
-        )
-    );
- 
-    boost::asio::async_write(
-        socket,
-        boost::asio::buffer( (char *)buf, count ),
-        boost::asio::transfer_at_least( count ), // want to transfer ALL of it
-        boost::bind(
-            set_bytes_result,
-            &write_result,
-            &bytes_transferred,
-            boost::asio::placeholders::error,
-            boost::asio::placeholders::bytes_transferred
-        )
-    );
- 
-    socket.get_io_service().reset();
- 
-    size_t result = -1;
-    bool resultset = false;
-    while ( socket.get_io_service().run_one() ) 
-		{
-        if ( write_result ) 
-				{
-            timer.cancel();
-            if ( resultset == false ) 
-						{
-                result = ( bytes_transferred <= 0 ) ? -1 : bytes_transferred;
-                resultset = true;
-            }
-            write_result.reset();
-        } 
-				else if ( timer_result ) 
-				{
-            socket.cancel();
-            if ( resultset == false ) 
-						{
-                result = 0;
-                resultset = true;
-            }
-            timer_result.reset();
-        }
-    }
-    return( result );
+		if (connection->output_backlog() == 0)
+			connection->output_queued_at = latency_recorder::clock_type::now();
+		
+		connection->output.append(line, size);
 }
 
 void process_line(boost::shared_ptr<my_connection> connection, std::string& line)
 {
-		boost::asio::ip::tcp::socket	&socket = *(connection->socket);
-		
-		std::cerr << "Bytes to write: " + line << "\n";
-		
-		while (connection->close == false)
-		{
-			ssize_t bytes_sent = write_with_timeout(
-					socket,									// socket to write to
-					line.c_str(),						// message to write 
-					line.size(),						// size of the message
-					1												// timeout in seconds
-			);
-			
-			std::cout << "________bytes_sent:_____________" << bytes_sent << "\n";
-			
-			if (bytes_sent == line.size())
-				break;
-			
-			if (bytes_sent < 0)
-				break;										// connection error or close
-			
-			if (bytes_sent == 0)				// timeout
-				continue;
-		}
+		process_line(connection, line.data(), line.size());
 }
 
+/**
+ * serves one connection until it is closed
+ *
+ * a single wait_for_io() both reads and drains the connection's output, so a
+ * slow reader never blocks our reads outright; but once its backlog passes
+ * OUTPUT_HIGH_WATERMARK we stop reading (the peer's writes then back up in
+ * TCP flow control) until the backlog is down to OUTPUT_LOW_WATERMARK. One
+ * read adds at most sizeof(acBuffer) bytes of output, so the backlog stays
+ * below OUTPUT_HIGH_WATERMARK + sizeof(acBuffer).
+ */
 void worker(boost::shared_ptr<my_connection> connection) 
 {
-		std::cout << "____worker(boost::shared_ptr<my_connection> connection)_____\n";
-		
     boost::asio::ip::tcp::socket &socket 				= 	*(connection->socket);
-    boost::asio::socket_base::non_blocking_io 			make_non_blocking( true );
     
-		socket.io_control( make_non_blocking );
+		socket.non_blocking( true );
  
     char acBuffer[1024];
-    std::string line("");
+    line_splitter lines;
+    bool first_read = true;
+    bool reading = true;			// false while the peer's backlog is too large
+    latency_recorder &latencies = latency_recorder::instance();
  
     while ( connection->close == false ) 
 		{
-        ssize_t bytes_read = read_with_timeout(
-            socket, // socket to read
+        io_result result = wait_for_io(
+            socket, // socket to read and write
             acBuffer, // buffer to read into
             sizeof(acBuffer), // maximum size of buffer
+            reading, // whether to read at all
+            connection->output.data() + connection->output_sent, // unsent output
+            connection->output_backlog(),
             1 // timeout in seconds
         );
  
-				std::cout << "_____Bytes Read:__________" << acBuffer << "\n";
-				std::cout << "___bytes_read:__________" << bytes_read << "\n";
-				
-        if ( bytes_read < 0 )
+        if ( result.read < 0 || result.written < 0 )
             break; // connection error or close
- 
-        if ( bytes_read == 0 ) 
-				{
-            continue; // timeout
-				}
-        char const *pend = acBuffer + bytes_read;
-        char const *pstart = acBuffer;
-        char const *pchar = pstart;
-        // buffer may legitimately contain '\0' from network
-        // so we must always ensure we don't go over the number
-        // of bytes actually read
-        while ( ( pchar < pend ) && ( *pchar != '\0' ) ) 
-				{
-            if ( ( *pchar != '\n' ) && ( *pchar != '\r' ) ) 
-						{
-                pchar++;
-                continue;
+
+        if ( result.written > 0 )
+        {
+            connection->output_sent += result.written;
+            if ( connection->output_backlog() == 0 )
+            {
+                latencies.record_since( handler_to_write_complete, connection->output_queued_at );
+                connection->output.clear();
+                connection->output_sent = 0;
             }
-						std::cout << "________Calling process_line(...)_________\n";
-            // non-blank line detected?
-            if ( pchar > pstart ) 
-						{
-                line += std::string( pstart, pchar - pstart );
-                // ***THIS IS WHAT WE ULTIMATELY WANTED TO ACHIEVE!!!***
-								
-                process_line(connection, line );
-                line = "";
+        }
+
+        if ( result.read > 0 )
+        {
+            latency_recorder::clock_type::time_point read_at = latency_recorder::clock_type::now();
+            if ( first_read )
+            {
+                latencies.record( accept_to_first_byte, read_at - connection->accepted_at );
+                first_read = false;
             }
- 
-            // skip over newlines
-            while ( ( pchar < pend ) && ( ( *pchar == '\n' ) || ( *pchar == '\r' ) ) )
-                pchar++;
- 
-            pstart = pchar;
-            continue;
+
+            // sent bytes are dropped before appending, so the output buffer
+            // does not grow with everything ever sent
+            if ( connection->output_sent > 0 )
+            {
+                connection->output.erase( 0, connection->output_sent );
+                connection->output_sent = 0;
+            }
+
+            // buffer may legitimately contain '\0' from network
+            // so we must always ensure we don't go over the number
+            // of bytes actually read; complete lines are passed as
+            // spans into acBuffer, only a line split across reads
+            // is copied
+            lines.split(
+                acBuffer,
+                acBuffer + result.read,
+                [&connection, &latencies, read_at](const char *line, size_t size)
+                {
+                    latencies.record_since( read_to_handler, read_at );
+                    // ***THIS IS WHAT WE ULTIMATELY WANTED TO ACHIEVE!!!***
+                    process_line(connection, line, size);
+                }
+            );
         }
- 
-        if ( pchar > pstart ) 
-				{
-            // put remaining non-terminated text into line buffer
-            line += std::string( pstart, pchar - pstart );
+
+        size_t backlog = connection->output_backlog();
+        if ( reading && backlog >= OUTPUT_HIGH_WATERMARK )
+        {
+            reading = false;
+        }
+        else if ( !reading && backlog <= OUTPUT_LOW_WATERMARK )
+        {
+            reading = true;
         }
     } // while connection not to be closed
 }
 
-
 class my_server
 {
 	public:
+		/**
+		 * adopted_listener: a listening socket taken over from the process
+		 * this one replaces (hot restart), used instead of binding "endpoint"
+		 *
+		 * pending_accepts: async_accept operations kept outstanding
+		 *
+		 * limits: connection caps and accept rate, see admission_control;
+		 * while over them the server stops accepting, and newcomers wait in
+		 * the listen backlog
+		 */
 		my_server(
 				boost::asio::io_service* io_service,
-				const boost::asio::ip::tcp::endpoint& endpoint
-		)
+				const boost::asio::ip::tcp::endpoint& endpoint,
+				int adopted_listener = -1,
+				size_t pending_accepts = DEFAULT_PENDING_ACCEPTS,
+				const admission_limits& limits = admission_limits()
+		) :
+			accept_strand(*io_service),
+			pending_accepts(std::max<size_t>(1, pending_accepts)),
+			armed_accepts(0),
+			live(new std::atomic<size_t>(0)),
+			admission(new admission_control(limits))
 		{
 			this->io_service = io_service;
     this->failed = false; // indicator whether construction failed
@@ -289,6 +306,13 @@ class my_server
     try {
         this->acceptor = new boost::asio::ip::tcp::acceptor(*io_service);
  
+        if ( adopted_listener >= 0 )
+        {
+            // already bound and listening, with its backlog intact
+            this->acceptor->assign(endpoint.protocol(), adopted_listener);
+        }
+        else
+        {
         // Open the acceptor with the option to reuse the address
         // (i.e. SO_REUSEADDR)
         this->acceptor->open(endpoint.protocol());
@@ -297,6 +321,7 @@ class my_server
 												);
         this->acceptor->bind(endpoint);
         this->acceptor->listen();
+        }
     } 
 		catch (boost::system::system_error e) {
         std::cerr << "Error binding to " << endpoint.address().to_string() << ":" << endpoint.port() << ": " << e.what() << std::endl;
@@ -305,61 +330,306 @@ class my_server
     }
  
     // successful bind!
-    // Now create a new "my_connection" object to receive new accepted socket
-    this->connection = boost::shared_ptr<my_connection>(
-													new my_connection() 
-											);
-    this->connection->master_io_service = this->io_service;
-    this->acceptor->async_accept(
-        *(this->connection->socket), // new connection is stored here
-        this->connection->endpoint, // where the remote address is stored
-        boost::bind(
-            &my_server::handle_accept, // function to call on accept()
-            this, // object functions need a pointer to their object
-            boost::asio::placeholders::error // argument to call-back function
-        )
-    );
+    // the batch accept in handle_accept() must not block once the queue is empty
+    boost::system::error_code ignored;
+    this->acceptor->non_blocking(true, ignored);
+ 
+    // keep several accepts outstanding, so a connection that arrives while
+    // one handler is busy starting a thread is taken by another
+    resume_accept();
 		}
 		
-		void handle_accept(const boost::system::error_code& error)
+		~my_server()
 		{
+			// worker threads releasing their connections must not resume us anymore
+			this->admission->close();
+		}
+		
+		void handle_accept(boost::shared_ptr<my_connection> accepted, const boost::system::error_code& error)
+		{
+			this->armed_accepts--;
+			
 			if ( error ) {
-        // accept failed
+        // stop_accepting() closed the acceptor
+        if ( error == boost::asio::error::operation_aborted )
+            return;
+
+        // the live connections carry on, and so does this accept
         std::cerr << "Acceptor failed: " << error.message() << std::endl;
+        retry_accept( error );
         return;
     }
  
-    std::cout << "Accepted connection from " << this->connection->endpoint.address().to_string() << ":" << this->connection->endpoint.port() << std::endl;
+    start_worker(accepted);
  
-    // time to create a thread and let THAT deal with the socket synchronously!
-    this->connection->thread = boost::shared_ptr<boost::thread>(
-        new boost::thread(worker, this->connection)
-    );
+    // the wakeup that completed this accept may have more connections
+    // queued behind it: take them now, without going back through the
+    // reactor, until the queue is empty (would_block) or the batch is full
+    for ( size_t i = 0; i < ACCEPT_BATCH && this->acceptor->is_open(); i++ )
+    {
+        if ( !may_accept() )
+            return; // the armed accepts take the rest of the budget
+
+        boost::system::error_code batch_error;
+        boost::shared_ptr<my_connection> next = new_connection( batch_error );
+        if ( !batch_error )
+            this->acceptor->accept(*(next->socket), next->endpoint, batch_error);
+        if ( batch_error == boost::asio::error::would_block || batch_error == boost::asio::error::try_again )
+            break; // queue empty
+        if ( batch_error )
+        {
+            std::cerr << "Acceptor failed: " << batch_error.message() << std::endl;
+            retry_accept( batch_error );
+            return;
+        }
+        start_worker(next);
+    }
  
     // re-build accept call
-    // we need a new socket/connection class
-    this->connection = boost::shared_ptr<my_connection>(
-        new my_connection() 
-    );
-    this->connection->master_io_service = this->io_service;
-    this->acceptor->async_accept(
-        *(this->connection->socket),
-        this->connection->endpoint,
-        boost::bind(
-            &my_server::handle_accept,
-            this,
-            boost::asio::placeholders::error
-        )
-    );
+    resume_accept();
+		}
+		
+		/**
+		 * the listening socket, to hand to the process replacing this one
+		 */
+		int listener()
+		{
+			return this->acceptor->native_handle();
+		}
+		
+		/**
+		 * stops accepting; connections already accepted carry on. After a
+		 * hot restart this only drops our descriptor, the listening socket
+		 * lives on in the new process.
+		 */
+		void stop_accepting()
+		{
+			// the acceptor is only touched from accept_strand
+			accept_strand.dispatch(
+				[this]()
+				{
+					boost::system::error_code ignored;
+					this->acceptor->close(ignored);
+				}
+			);
+		}
+		
+		admission_control::admission_stats admission_stats()
+		{
+			return this->admission->stats();
+		}
+		
+		/**
+		 * connections whose worker() thread is still running
+		 */
+		size_t live_connections() const
+		{
+			return *this->live;
 		}
 		
 		bool failed;
 		
 	private:
+		/**
+		 * the connection's own io_service takes descriptors too, so running
+		 * out of them may show here first, before accept() reports it
+		 */
+		boost::shared_ptr<my_connection> new_connection(boost::system::error_code& error)
+		{
+			boost::shared_ptr<my_connection> connection;
+			try {
+				connection.reset(new my_connection());
+			}
+			catch (const boost::system::system_error& e) {
+				error = e.code();
+				return connection;
+			}
+			connection->master_io_service = this->io_service;
+			return connection;
+		}
+		
+		/**
+		 * arms one more accept; false when there is no room for it or it
+		 * could not be set up
+		 */
+		bool start_accept()
+		{
+			if ( !may_accept() )
+				return false;
+			
+			// we need a new socket/connection class for every accept
+			boost::system::error_code error;
+			boost::shared_ptr<my_connection> connection = new_connection( error );
+			if ( error )
+			{
+				std::cerr << "Acceptor failed: " << error.message() << std::endl;
+				retry_accept( error );
+				return false;
+			}
+			this->acceptor->async_accept(
+				*(connection->socket), // new connection is stored here
+				connection->endpoint, // where the remote address is stored
+				accept_strand.wrap(
+					boost::bind(
+						&my_server::handle_accept, // function to call on accept()
+						this, // object functions need a pointer to their object
+						connection,
+						boost::asio::placeholders::error // argument to call-back function
+					)
+				)
+			);
+			this->armed_accepts++;
+			return true;
+		}
+		
+		/**
+		 * asks the admission control whether there is room for one more
+		 * accept next to the ones armed. Nothing is taken until start_worker()
+		 * admits the connection, so the pending_accepts waiting for peers do
+		 * not lower the limit; but a burst completes all of them at once, so
+		 * no more are armed than there are places and tokens for, or admit()
+		 * would have to refuse the rest.
+		 *
+		 * while accepts are armed, each one completing arms the next; with
+		 * none left resume_accept() runs once there is room: on a timer when
+		 * the accept rate was exceeded, when a connection ends when the server
+		 * was full.
+		 */
+		bool may_accept()
+		{
+			admission_control::clock_type::duration retry_after;
+			bool room = this->admission->may_accept(
+				retry_after,
+				[this]()
+				{
+					// on the worker thread whose connection ended
+					accept_strand.post( [this]() { resume_accept(); } );
+				},
+				this->armed_accepts
+			);
+			if ( room )
+				return true;
+			
+			if ( this->armed_accepts == 0 && retry_after > admission_control::clock_type::duration::zero() )
+			{
+				boost::shared_ptr<boost::asio::steady_timer> timer(
+					new boost::asio::steady_timer( *this->io_service, retry_after )
+				);
+				timer->async_wait(
+					accept_strand.wrap(
+						[this, timer](const boost::system::error_code &error)
+						{
+							if ( !error )
+								resume_accept();
+						}
+					)
+				);
+			}
+			return false;
+		}
+		
+		/**
+		 * arms accepts until pending_accepts are outstanding, or there is no
+		 * room for more
+		 */
+		void resume_accept()
+		{
+			// stop_accepting() may have closed the acceptor meanwhile
+			while ( this->acceptor->is_open() && this->armed_accepts < this->pending_accepts )
+			{
+				if ( !start_accept() )
+					break;
+			}
+		}
+		
+		/**
+		 * re-arms an accept that failed; out of descriptors or buffers, it
+		 * first waits ACCEPT_BACKOFF so closing connections can free some.
+		 * Every accept backs off on a timer of its own and counts as armed
+		 * meanwhile, so resume_accept() does not re-arm it early.
+		 */
+		void retry_accept(const boost::system::error_code& error)
+		{
+			if ( error == boost::asio::error::no_descriptors
+				|| error == boost::system::errc::too_many_files_open_in_system
+				|| error == boost::asio::error::no_buffer_space
+				|| error == boost::asio::error::no_memory )
+			{
+				boost::shared_ptr<boost::asio::steady_timer> timer(
+					new boost::asio::steady_timer( *this->io_service, ACCEPT_BACKOFF )
+				);
+				this->armed_accepts++;
+				timer->async_wait(
+					accept_strand.wrap(
+						[this, timer](const boost::system::error_code &timer_error)
+						{
+							this->armed_accepts--;
+							if ( !timer_error )
+								resume_accept();
+						}
+					)
+				);
+				return;
+			}
+			
+			// posted: start_accept() failing again must not recurse
+			accept_strand.post( [this]() { resume_accept(); } );
+		}
+		
+		/**
+		 * time to create a thread and let THAT deal with the socket synchronously!
+		 */
+		void start_worker(boost::shared_ptr<my_connection> accepted)
+		{
+			// the connection takes its place in the admission control here,
+			// or is refused: the other outstanding accepts may have taken the
+			// last place or token, or its address has too many already
+			boost::asio::ip::address peer = accepted->endpoint.address();
+			if ( !this->admission->admit( peer ) )
+			{
+				boost::system::error_code ignored;
+				accepted->socket->close( ignored );
+				return;
+			}
+			
+			accepted->accepted_at = std::chrono::steady_clock::now();
+			
+			// the counter and the admission control are shared with the
+			// thread, which may outlive the server
+			boost::shared_ptr<std::atomic<size_t> > live = this->live;
+			boost::shared_ptr<admission_control> admission = this->admission;
+			++*live;
+			try {
+				// detached: the thread's function owns the connection, so the
+				// connection keeping the thread would keep both forever, with
+				// the socket and the io_service's descriptors
+				boost::thread(
+					[accepted, live, admission, peer]()
+					{
+						worker(accepted);
+						--*live;
+						admission->release( peer );
+					}
+				).detach();
+			}
+			catch (const boost::thread_resource_error& e) {
+				// out of threads: the peer is turned away, accepting goes on
+				std::cerr << "Worker failed: " << e.what() << std::endl;
+				--*live;
+				admission->release( peer );
+				boost::system::error_code ignored;
+				accepted->socket->close( ignored );
+			}
+		}
+		
 		boost::asio::io_service		*io_service;
 		boost::asio::ip::tcp::endpoint			endpoint;
 		boost::asio::ip::tcp::acceptor			*acceptor;
-		boost::shared_ptr<my_connection>		connection;
+		boost::asio::io_service::strand			accept_strand;		// serializes everything done with acceptor
+		size_t									pending_accepts;
+		size_t									armed_accepts;		// async_accepts and back-offs outstanding, on accept_strand
+		boost::shared_ptr<std::atomic<size_t> >	live;
+		boost::shared_ptr<admission_control>	admission;
 };
 
 
@@ -0,0 +1,369 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/**
+ * hierarchical hashed timer wheel
+ *
+ * all deadlines share one steady_timer that ticks at a coarse resolution.
+ * A deadline is an intrusive list node hooked into a slot of one of the
+ * wheels, so arming and cancelling are O(1) and never touch the io_service's
+ * timer heap. Deadlines further away than the first wheel sit in coarser
+ * wheels and cascade down as time advances.
+ *
+ * arm() and cancel() may be called from any thread. Callbacks run on the
+ * thread running the wheel's io_service, never under the wheel's lock.
+ */
+class timer_wheel
+{
+	public:
+		typedef boost::function<void ()> callback_type;
+
+		/**
+		 * a deadline slot, typically a member of the connection it guards;
+		 * it must stay alive while armed
+		 */
+		class entry
+		{
+			public:
+				entry() : prev(nullptr), next(nullptr), wheel(nullptr), expiry(0) {}
+
+				~entry()
+				{
+					if (wheel)
+						wheel->cancel(*this);
+				}
+
+			private:
+				friend class timer_wheel;
+
+				entry(const entry&);
+				entry& operator=(const entry&);
+
+				entry			*prev;
+				entry			*next;
+				timer_wheel		*wheel;			// non-null while armed
+				uint64_t		expiry;			// in ticks
+				callback_type	callback;
+		};
+
+		timer_wheel(
+				boost::asio::io_service &io_service,
+				std::chrono::milliseconds tick = std::chrono::milliseconds(100)
+		) :
+			timer(io_service),
+			tick(tick),
+			start(std::chrono::steady_clock::now()),
+			current(0)
+		{
+			for (size_t level = 0; level < LEVELS; level++)
+				for (size_t slot = 0; slot < SLOTS; slot++)
+					slots[level][slot].prev = slots[level][slot].next = &slots[level][slot];
+
+			schedule_tick();
+		}
+
+		~timer_wheel()
+		{
+			stop();
+		}
+
+		/**
+		 * (re)arms "e" to call "callback" after "timeout", rounded up to a tick
+		 *  the expiry counts from now rather than from "current", which lags
+		 *  behind the clock by up to a tick and would fire that much early
+		 */
+		void arm(entry &e, std::chrono::milliseconds timeout, callback_type callback)
+		{
+			std::chrono::steady_clock::duration due = std::chrono::steady_clock::now() - start + timeout;
+			uint64_t expiry = (due + tick - std::chrono::steady_clock::duration(1)) / tick;
+
+			boost::mutex::scoped_lock lock(mutex);
+			if (e.wheel)
+				unlink(e);
+			e.wheel = this;
+			e.expiry = std::max(expiry, current + 1);
+			e.callback.swap(callback);
+			insert(e);
+		}
+
+		/**
+		 * returns false if "e" was not armed, i.e. it already fired or was never armed
+		 */
+		bool cancel(entry &e)
+		{
+			callback_type callback;
+
+			boost::mutex::scoped_lock lock(mutex);
+			if (!e.wheel)
+				return false;
+			unlink(e);
+			e.wheel = nullptr;
+			callback.swap(e.callback);		// released outside the lock
+			lock.unlock();
+			return true;
+		}
+
+		void stop()
+		{
+			boost::system::error_code ignored;
+			timer.cancel(ignored);
+		}
+
+	private:
+		static const size_t BITS = 8;
+		static const size_t SLOTS = size_t(1) << BITS;
+		static const size_t LEVELS = 4;		// 2^32 ticks, ~13 years at 100ms
+
+		static void link(entry &head, entry &e)
+		{
+			e.prev = head.prev;
+			e.next = &head;
+			head.prev->next = &e;
+			head.prev = &e;
+		}
+
+		static void unlink(entry &e)
+		{
+			e.prev->next = e.next;
+			e.next->prev = e.prev;
+			e.prev = e.next = nullptr;
+		}
+
+		void insert(entry &e)
+		{
+			uint64_t delta = e.expiry > current ? e.expiry - current : 0;
+
+			size_t level = 0;
+			while (level + 1 < LEVELS && delta >= (uint64_t(1) << (BITS * (level + 1))))
+				level++;
+
+			link(slots[level][(e.expiry >> (BITS * level)) & (SLOTS - 1)], e);
+		}
+
+		/**
+		 * moves the entries of the current slot of "level" down to finer wheels,
+		 * returns the slot index so the caller knows whether the next level wrapped too
+		 */
+		size_t cascade(size_t level)
+		{
+			size_t index = (current >> (BITS * level)) & (SLOTS - 1);
+			entry &head = slots[level][index];
+
+			while (head.next != &head)
+			{
+				entry &e = *head.next;
+				unlink(e);
+				insert(e);
+			}
+			return index;
+		}
+
+		void schedule_tick()
+		{
+			timer.expires_at(start + tick * (current + 1));
+			timer.async_wait(
+				boost::bind(&timer_wheel::handle_tick, this, boost::asio::placeholders::error)
+			);
+		}
+
+		void handle_tick(const boost::system::error_code &error)
+		{
+			if (error == boost::asio::error::operation_aborted)
+				return;
+
+			uint64_t target = (std::chrono::steady_clock::now() - start) / tick;
+
+			boost::mutex::scoped_lock lock(mutex);
+			while (current < target)
+			{
+				current++;
+
+				size_t level = 1;
+				if ((current & (SLOTS - 1)) == 0)
+					while (level < LEVELS && cascade(level) == 0)
+						level++;
+
+				entry &head = slots[0][current & (SLOTS - 1)];
+				while (head.next != &head)
+				{
+					entry &e = *head.next;
+					unlink(e);
+					e.wheel = nullptr;
+					expired.push_back(callback_type());
+					expired.back().swap(e.callback);
+				}
+			}
+			lock.unlock();
+
+			// the entries are disarmed already, so callbacks may re-arm them
+			for (size_t i = 0; i < expired.size(); i++)
+				expired[i]();
+			expired.clear();
+
+			schedule_tick();
+		}
+
+		boost::asio::steady_timer				timer;
+		std::chrono::milliseconds				tick;
+		std::chrono::steady_clock::time_point	start;
+		uint64_t								current;	// ticks since start
+		boost::mutex							mutex;
+		entry									slots[LEVELS][SLOTS];	// list heads
+		std::vector<callback_type>				expired;
+};
+
+/**
+ * per-operation deadline of one socket, built on a timer_wheel entry
+ *
+ * arm() before starting an operation and disarm() in its completion handler.
+ * Both, and the expiry, run on "strand", so an expiry that races with the
+ * completion is recognised by its generation and never cancels a later
+ * operation on the same socket.
+ */
+class socket_deadline
+{
+	public:
+		socket_deadline(
+				timer_wheel &wheel,
+				boost::asio::io_service::strand &strand,
+				boost::asio::ip::tcp::socket &socket
+		) :
+			wheel(wheel),
+			strand(strand),
+			socket(socket),
+			generation(0),
+			pending(false),
+			timed_out(false)
+		{}
+
+		/**
+		 * "owner" is kept alive until the deadline fired or was disarmed
+		 */
+		void arm(std::chrono::milliseconds timeout, boost::shared_ptr<void> owner)
+		{
+			generation++;
+			pending = true;
+			timed_out = false;
+
+			wheel.arm(
+				entry,
+				timeout,
+				strand.wrap(boost::bind(&socket_deadline::expire, this, generation, owner))
+			);
+		}
+
+		/**
+		 * returns true if the operation was cancelled because the deadline passed
+		 */
+		bool disarm()
+		{
+			pending = false;
+			wheel.cancel(entry);
+			return timed_out;
+		}
+
+	private:
+		void expire(uint64_t expired_generation, boost::shared_ptr<void>)
+		{
+			if (!pending || expired_generation != generation)
+				return;
+
+			timed_out = true;
+			boost::system::error_code ignored;
+			socket.cancel(ignored);
+		}
+
+		timer_wheel							&wheel;
+		boost::asio::io_service::strand		&strand;
+		boost::asio::ip::tcp::socket		&socket;
+		timer_wheel::entry					entry;
+		uint64_t							generation;
+		bool								pending;
+		bool								timed_out;
+};
+
+/**
+ * completion wrapper used by the *_with_deadline functions: disarms the
+ * deadline and reports error::timed_out instead of operation_aborted
+ */
+template <typename Handler>
+class deadline_handler
+{
+	public:
+		deadline_handler(socket_deadline &deadline, Handler handler) :
+			deadline(&deadline),
+			handler(handler)
+		{}
+
+		void operator()(const boost::system::error_code &error, size_t bytes_transferred)
+		{
+			if (deadline->disarm() && error == boost::asio::error::operation_aborted)
+				handler(boost::asio::error::timed_out, bytes_transferred);
+			else
+				handler(error, bytes_transferred);
+		}
+
+	private:
+		socket_deadline		*deadline;
+		Handler				handler;
+};
+
+/**
+ * async_read_some() that fails with error::timed_out after "timeout"
+ *
+ * must be started on the deadline's strand; the handler runs on it too
+ */
+template <typename MutableBufferSequence, typename ReadHandler>
+void async_read_some_with_deadline(
+		boost::asio::ip::tcp::socket &socket,
+		boost::asio::io_service::strand &strand,
+		socket_deadline &deadline,
+		const MutableBufferSequence &buffers,
+		std::chrono::milliseconds timeout,
+		boost::shared_ptr<void> owner,
+		ReadHandler handler
+)
+{
+	deadline.arm(timeout, owner);
+	socket.async_read_some(
+		buffers,
+		strand.wrap(deadline_handler<ReadHandler>(deadline, handler))
+	);
+}
+
+/**
+ * async_write() of the whole buffer that fails with error::timed_out after "timeout"
+ *
+ * must be started on the deadline's strand; the handler runs on it too
+ */
+template <typename ConstBufferSequence, typename WriteHandler>
+void async_write_with_deadline(
+		boost::asio::ip::tcp::socket &socket,
+		boost::asio::io_service::strand &strand,
+		socket_deadline &deadline,
+		const ConstBufferSequence &buffers,
+		std::chrono::milliseconds timeout,
+		boost::shared_ptr<void> owner,
+		WriteHandler handler
+)
+{
+	deadline.arm(timeout, owner);
+	boost::asio::async_write(
+		socket,
+		buffers,
+		strand.wrap(deadline_handler<WriteHandler>(deadline, handler))
+	);
+}
+
+#endif
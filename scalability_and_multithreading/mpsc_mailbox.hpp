@@ -0,0 +1,219 @@
+#ifndef MPSC_MAILBOX_HPP
+#define MPSC_MAILBOX_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/system/system_error.hpp>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * bounded lock-free queue of T from any number of threads to the io_service
+ * that owns the mailbox (asio_steady_timer_example_four: one io_service per
+ * thread)
+ *
+ * io_service::post() takes the io_service's lock and allocates an operation
+ * for every handler. send() here copies the message into a preallocated slot
+ * with one CAS and, only if the owner is waiting, writes an eventfd. The
+ * owner's io_service then wakes up once and hands every queued message to the
+ * receive handler in one go.
+ *
+ *   mpsc_mailbox<message> mailbox(owner_io_service, 4096);
+ *   mailbox.start([](message &m) { ... });    // runs on owner_io_service
+ *   mailbox.send(m);                          // from any thread
+ *
+ * send() fails when the mailbox is full; what to do then (retry, drop, fall
+ * back to post()) is the sender's call. T needs a default constructor and
+ * move assignment.
+ */
+template <class T>
+class mpsc_mailbox
+{
+	public:
+		typedef std::function<void (T&)> handler_type;
+
+		/**
+		 * "capacity" is rounded up to a power of two; at most "batch"
+		 * messages are handled before other handlers get a turn
+		 */
+		mpsc_mailbox(boost::asio::io_service &io_service, size_t capacity, size_t batch = 256) :
+			io_service(io_service),
+			wakeup(io_service),
+			batch(batch),
+			enqueue_at(0),
+			dequeue_at(0),
+			waiting(false),
+			stopped(false)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size *= 2;
+			mask = size - 1;
+
+			cells.reset(new cell[size]);
+			for (size_t i = 0; i < size; i++)
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+
+			int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (fd < 0)
+				throw boost::system::system_error(errno, boost::system::system_category(), "eventfd");
+			wakeup.assign(fd);
+		}
+
+		/**
+		 * starts handing messages to "handler" on the owner's io_service
+		 */
+		void start(handler_type handler)
+		{
+			receive = handler;
+			io_service.post([this]() { drain(); });
+		}
+
+		/**
+		 * stops receiving; call from the owner's io_service. Messages still
+		 * queued are left in the mailbox. Destroy the mailbox only after the
+		 * io_service has run what was queued before stop(), or has stopped.
+		 */
+		void stop()
+		{
+			stopped = true;
+			boost::system::error_code ignored;
+			wakeup.close(ignored);
+		}
+
+		/**
+		 * queues "message" from any thread; false when the mailbox is full
+		 */
+		bool send(T message)
+		{
+			cell *c;
+			size_t position = enqueue_at.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				c = &cells[position & mask];
+				size_t sequence = c->sequence.load(std::memory_order_acquire);
+				intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+				if (difference == 0)
+				{
+					if (enqueue_at.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (difference < 0)
+					return false;		// the slot still holds a message from a lap ago
+				else
+					position = enqueue_at.load(std::memory_order_relaxed);
+			}
+
+			c->message = std::move(message);
+			c->sequence.store(position + 1, std::memory_order_release);
+
+			// pairs with the fence in arm(): either the owner sees the message
+			// or we see that it waits
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (waiting.load(std::memory_order_relaxed) && waiting.exchange(false))
+			{
+				std::uint64_t one = 1;
+				ssize_t ignored = ::write(wakeup.native_handle(), &one, sizeof(one));
+				(void)ignored;
+			}
+			return true;
+		}
+
+	private:
+		mpsc_mailbox(const mpsc_mailbox&);
+		mpsc_mailbox& operator=(const mpsc_mailbox&);
+
+		struct cell
+		{
+			std::atomic<size_t>		sequence;	// position + 1 once it holds a message
+			T						message;
+		};
+
+		/**
+		 * the owner's side: the oldest message, if it has been written
+		 */
+		bool take(T &message)
+		{
+			cell &c = cells[dequeue_at & mask];
+			if (c.sequence.load(std::memory_order_acquire) != dequeue_at + 1)
+				return false;
+
+			message = std::move(c.message);
+			c.sequence.store(dequeue_at + mask + 1, std::memory_order_release);
+			dequeue_at++;
+			return true;
+		}
+
+		bool empty() const
+		{
+			return cells[dequeue_at & mask].sequence.load(std::memory_order_acquire) != dequeue_at + 1;
+		}
+
+		void drain()
+		{
+			if (stopped)
+				return;
+
+			T message;
+			for (size_t i = 0; i < batch && take(message); i++)
+				receive(message);
+
+			// more than one batch: let the io_service's other handlers run first
+			if (!empty())
+			{
+				io_service.post([this]() { drain(); });
+				return;
+			}
+
+			arm();
+		}
+
+		/**
+		 * waits for the eventfd, unless a message slipped in meanwhile
+		 */
+		void arm()
+		{
+			waiting.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			// a sender that saw waiting == true writes the eventfd; if we take
+			// the flag back ourselves, nobody did
+			if (!empty() && waiting.exchange(false))
+			{
+				io_service.post([this]() { drain(); });
+				return;
+			}
+
+			wakeup.async_read_some(
+				boost::asio::buffer(&counter, sizeof(counter)),
+				[this](const boost::system::error_code &error, size_t)
+				{
+					if (!error)
+						drain();
+				}
+			);
+		}
+
+		boost::asio::io_service						&io_service;
+		boost::asio::posix::stream_descriptor		wakeup;			// eventfd
+		std::uint64_t								counter;
+		handler_type								receive;
+		size_t										batch;
+		size_t										mask;
+		std::unique_ptr<cell[]>						cells;
+
+		std::atomic<size_t>							enqueue_at;		// senders
+		char										padding[64];	// keeps senders off the owner's cache line
+		size_t										dequeue_at;		// owner only
+		std::atomic<bool>							waiting;		// owner is, or is about to be, in async_read_some
+		bool										stopped;
+};
+
+#endif
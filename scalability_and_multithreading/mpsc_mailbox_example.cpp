@@ -0,0 +1,215 @@
+// Fan-out between io_services, one per thread (asio_steady_timer_example_four):
+// every shard sends "messages" messages to every other shard, once through
+// io_service::post() and once through the shards' mpsc_mailboxes.
+//
+// usage: mpsc_mailbox_example [shards [messages [capacity]]]
+//        defaults: 4, 200000, 4096
+//
+// A shard sends from its own io_service, a chunk at a time, and posts the rest
+// of its work behind its own handlers: a sender that spun on a full mailbox
+// would stop draining its own, and two shards sending to each other would wait
+// for one another forever.
+
+#include <boost/asio/io_service.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "mpsc_mailbox.hpp"
+
+using namespace boost::asio;
+
+struct message
+{
+	size_t			from;
+	std::uint64_t	sequence;
+};
+
+// messages sent in one go before a shard lets its other handlers run
+const size_t SEND_CHUNK = 512;
+
+/**
+ * counts received messages; the last one fulfils "done"
+ */
+class completion
+{
+	public:
+		explicit completion(unsigned long expected) : left(expected) {}
+
+		void received(unsigned long n = 1)
+		{
+			if (left.fetch_sub(n, std::memory_order_acq_rel) == n)
+				done.set_value();
+		}
+
+		void wait()
+		{
+			done.get_future().wait();
+		}
+
+	private:
+		std::atomic<unsigned long>	left;
+		std::promise<void>			done;
+};
+
+struct shard
+{
+	shard() : keep_running(new io_service::work(service)), checksum(0), full(0) {}
+
+	io_service								service;
+	std::unique_ptr<io_service::work>		keep_running;
+	std::unique_ptr<mpsc_mailbox<message> >	mailbox;
+	std::uint64_t							checksum;		// owner only
+	unsigned long							full;			// send() refused, owner only
+};
+
+typedef std::vector<std::unique_ptr<shard> > shard_list;
+
+/**
+ * runs every shard's io_service on its own thread until "done", then stops them
+ */
+double run_shards(shard_list &shards, completion &done)
+{
+	auto started = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (auto &s: shards)
+	{
+		io_service *service = &s->service;
+		threads.emplace_back([service]() { service->run(); });
+	}
+
+	done.wait();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	for (auto &s: shards)
+		s->keep_running.reset();
+	for (auto &s: shards)
+		s->service.stop();
+	for (auto &thread: threads)
+		thread.join();
+
+	return seconds;
+}
+
+/**
+ * every shard got every other shard's messages 0 .. count - 1, each once
+ */
+const char* checksums(const shard_list &shards, std::uint64_t count)
+{
+	std::uint64_t expected = (shards.size() - 1) * (count * (count - 1) / 2);
+	for (auto &s: shards)
+		if (s->checksum != expected)
+			return "checksum mismatch";
+	return "checksums ok";
+}
+
+/**
+ * shard "from" sends messages [0, count) to every other shard with "send",
+ * which returns false when the message has to be sent again later; "step" is
+ * message * shards + target, where to carry on
+ */
+template <class Send>
+void send_chunk(shard_list &shards, size_t from, std::uint64_t step, std::uint64_t count, Send send)
+{
+	std::uint64_t steps = count * shards.size();
+	std::uint64_t end = std::min(steps, step + SEND_CHUNK * shards.size());
+
+	for (; step < end; step++)
+	{
+		size_t to = step % shards.size();
+		if (to == from)
+			continue;
+
+		if (!send(to, message{from, step / shards.size()}))
+		{
+			// a full mailbox: give its owner the CPU, and come back once our
+			// own handlers had their turn
+			shards[from]->full++;
+			std::this_thread::yield();
+			break;
+		}
+	}
+
+	if (step < steps)
+		shards[from]->service.post([&shards, from, step, count, send]()
+		{
+			send_chunk(shards, from, step, count, send);
+		});
+}
+
+int main(int argc, char* argv[])
+{
+	size_t shard_count = std::max(2ul, argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4);
+	std::uint64_t messages = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 200000;
+	size_t capacity = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4096;
+
+	unsigned long expected = shard_count * (shard_count - 1) * messages;
+	std::printf("%zu shards, %llu messages to each other shard, mailbox capacity %zu\n",
+				shard_count, static_cast<unsigned long long>(messages), capacity);
+
+	// io_service::post(): a lock and an allocated handler per message
+	{
+		shard_list shards;
+		for (size_t i = 0; i < shard_count; i++)
+			shards.emplace_back(new shard());
+		completion done(expected);
+
+		auto send = [&shards, &done](size_t to, message m)
+		{
+			shard *target = shards[to].get();
+			target->service.post([target, &done, m]()
+			{
+				target->checksum += m.sequence;
+				done.received();
+			});
+			return true;
+		};
+		for (size_t i = 0; i < shard_count; i++)
+			shards[i]->service.post([&shards, i, messages, send]() { send_chunk(shards, i, 0, messages, send); });
+
+		double seconds = run_shards(shards, done);
+		std::printf("io_service::post  %9.3f s %14.0f messages/s, %s\n",
+					seconds, expected / seconds, checksums(shards, messages));
+	}
+
+	// mpsc_mailbox: a CAS per message, an eventfd write per wakeup
+	{
+		shard_list shards;
+		for (size_t i = 0; i < shard_count; i++)
+			shards.emplace_back(new shard());
+		completion done(expected);
+
+		for (auto &s: shards)
+		{
+			shard *owner = s.get();
+			owner->mailbox.reset(new mpsc_mailbox<message>(owner->service, capacity));
+			owner->mailbox->start([owner, &done](message &m)
+			{
+				owner->checksum += m.sequence;
+				done.received();
+			});
+		}
+
+		auto send = [&shards](size_t to, message m) { return shards[to]->mailbox->send(m); };
+		for (size_t i = 0; i < shard_count; i++)
+			shards[i]->service.post([&shards, i, messages, send]() { send_chunk(shards, i, 0, messages, send); });
+
+		double seconds = run_shards(shards, done);
+
+		unsigned long full = 0;
+		for (auto &s: shards)
+			full += s->full;
+		std::printf("mpsc_mailbox      %9.3f s %14.0f messages/s, %s, mailbox full %lu times\n",
+					seconds, expected / seconds, checksums(shards, messages), full);
+
+		// the io_services have stopped: nothing of the mailboxes' is queued anymore
+		for (auto &s: shards)
+			s->mailbox->stop();
+	}
+}
@@ -0,0 +1,250 @@
+// Compares three ways of spreading handlers over threads on a CPU-heavy,
+// unevenly sized workload:
+//
+//   shared io_service      "threads" threads call run() on one io_service
+//                          (asio_steady_timer_example_three)
+//   io_service per thread  one io_service per thread, handlers stay on the
+//                          io_service they were posted to
+//                          (asio_steady_timer_example_four)
+//   work stealing          one reactor thread, handlers run on a
+//                          work_stealing_executor of "threads" workers
+//
+// usage: work_stealing_benchmark [threads [roots [max-depth [work]]]]
+//        defaults: hardware threads, 256, 14, 200
+//
+// Each root arrives as a timer completion and unfolds into a binary tree of
+// handlers of random depth (0 to max-depth): every handler spins "work" rounds,
+// then posts its two children. Small "work" stresses the queues, large "work"
+// the balancing: the io_service per thread layout cannot move a deep tree off
+// the thread it landed on.
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "work_stealing_executor.hpp"
+
+using namespace boost::asio;
+
+std::atomic<unsigned long> sink(0);
+
+/**
+ * the CPU-heavy part of every handler
+ */
+void spin(unsigned int work)
+{
+	unsigned long x = work;
+	for (unsigned int i = 0; i < work; i++)
+		x = x * 6364136223846793005ul + 1442695040888963407ul;
+	sink.fetch_add(x & 1, std::memory_order_relaxed);
+}
+
+/**
+ * counts handlers still to run; the last one fulfils "done"
+ */
+class tree_counter
+{
+	public:
+		explicit tree_counter(unsigned long handlers) : left(handlers) {}
+
+		void finished()
+		{
+			if (left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				done.set_value();
+		}
+
+		void wait()
+		{
+			done.get_future().wait();
+		}
+
+	private:
+		std::atomic<unsigned long>	left;
+		std::promise<void>			done;
+};
+
+/**
+ * one root per tree, handlers in a tree of depth d: 2^(d+1) - 1
+ */
+std::vector<unsigned int> make_depths(unsigned int roots, unsigned int max_depth, unsigned long &handlers)
+{
+	std::mt19937 random(42);
+	std::uniform_int_distribution<unsigned int> depth(0, max_depth);
+
+	std::vector<unsigned int> depths;
+	handlers = 0;
+	for (unsigned int i = 0; i < roots; i++)
+	{
+		depths.push_back(depth(random));
+		handlers += (2ul << depths.back()) - 1;
+	}
+	return depths;
+}
+
+/**
+ * a handler of the tree; "post" puts a handler wherever the layout puts it
+ */
+template <class Post>
+void node(Post post, tree_counter &counter, unsigned int depth, unsigned int work)
+{
+	spin(work);
+	if (depth > 0)
+	{
+		post([post, &counter, depth, work]() { node(post, counter, depth - 1, work); });
+		post([post, &counter, depth, work]() { node(post, counter, depth - 1, work); });
+	}
+	counter.finished();
+}
+
+typedef std::vector<std::unique_ptr<steady_timer> > timer_list;
+
+void report(const char *layout, unsigned long handlers, std::chrono::steady_clock::time_point started,
+			long steals = -1)
+{
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	std::printf("%-22s %10lu %9.3f %14.0f", layout, handlers, seconds, handlers / seconds);
+	if (steals >= 0)
+		std::printf(" %10ld", steals);
+	std::printf("\n");
+}
+
+void shared_io_service(unsigned int threads, const std::vector<unsigned int> &depths, unsigned long handlers, unsigned int work)
+{
+	io_service ioservice;
+	io_service::work keep_running(ioservice);
+	tree_counter counter(handlers);
+
+	auto post = [&ioservice](std::function<void ()> handler) { ioservice.post(handler); };
+
+	timer_list timers;
+	for (auto depth: depths)
+	{
+		timers.emplace_back(new steady_timer(ioservice, std::chrono::steady_clock::now()));
+		timers.back()->async_wait([post, &counter, depth, work](const boost::system::error_code&)
+		{
+			node(post, counter, depth, work);
+		});
+	}
+
+	auto started = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (unsigned int i = 0; i < threads; i++)
+		pool.emplace_back([&ioservice]() { ioservice.run(); });
+
+	counter.wait();
+	report("shared io_service", handlers, started);
+
+	ioservice.stop();
+	for (auto &thread: pool)
+		thread.join();
+}
+
+/**
+ * the io_service whose thread is running the calling handler
+ */
+thread_local io_service *this_thread_service = nullptr;
+
+void io_service_per_thread(unsigned int threads, const std::vector<unsigned int> &depths, unsigned long handlers, unsigned int work)
+{
+	std::vector<std::unique_ptr<io_service> > services;
+	std::vector<std::unique_ptr<io_service::work> > keep_running;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		services.emplace_back(new io_service());
+		keep_running.emplace_back(new io_service::work(*services.back()));
+	}
+	tree_counter counter(handlers);
+
+	// children stay with their parent: nothing here could move them
+	auto post = [](std::function<void ()> handler) { this_thread_service->post(handler); };
+
+	timer_list timers;
+	for (size_t i = 0; i < depths.size(); i++)
+	{
+		unsigned int depth = depths[i];
+		timers.emplace_back(new steady_timer(*services[i % threads], std::chrono::steady_clock::now()));
+		timers.back()->async_wait([post, &counter, depth, work](const boost::system::error_code&)
+		{
+			node(post, counter, depth, work);
+		});
+	}
+
+	auto started = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		io_service *service = services[i].get();
+		pool.emplace_back([service]()
+		{
+			this_thread_service = service;
+			service->run();
+		});
+	}
+
+	counter.wait();
+	report("io_service per thread", handlers, started);
+
+	for (auto &service: services)
+		service->stop();
+	for (auto &thread: pool)
+		thread.join();
+}
+
+void work_stealing(unsigned int threads, const std::vector<unsigned int> &depths, unsigned long handlers, unsigned int work)
+{
+	io_service reactor;
+	io_service::work keep_running(reactor);
+	tree_counter counter(handlers);
+	work_stealing_executor executor(threads);
+
+	auto post = [&executor](std::function<void ()> handler) { executor.post(handler); };
+
+	// the reactor only hands the completions over to the executor
+	timer_list timers;
+	for (auto depth: depths)
+	{
+		timers.emplace_back(new steady_timer(reactor, std::chrono::steady_clock::now()));
+		timers.back()->async_wait(executor.wrap([post, &counter, depth, work](const boost::system::error_code&)
+		{
+			node(post, counter, depth, work);
+		}));
+	}
+
+	auto started = std::chrono::steady_clock::now();
+	std::thread reactor_thread([&reactor]() { reactor.run(); });
+
+	counter.wait();
+	report("work stealing", handlers, started, static_cast<long>(executor.steals()));
+
+	reactor.stop();
+	reactor_thread.join();
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+	unsigned int roots = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 256;
+	unsigned int max_depth = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 14;
+	unsigned int work = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 200;
+
+	threads = std::max(1u, threads);
+
+	unsigned long handlers;
+	std::vector<unsigned int> depths = make_depths(roots, max_depth, handlers);
+
+	std::printf("%u threads, %u roots, depth 0-%u, work %u\n", threads, roots, max_depth, work);
+	std::printf("%-22s %10s %9s %14s %10s\n", "layout", "handlers", "seconds", "handlers/s", "steals");
+
+	shared_io_service(threads, depths, handlers, work);
+	io_service_per_thread(threads, depths, handlers, work);
+	work_stealing(threads, depths, handlers, work);
+}
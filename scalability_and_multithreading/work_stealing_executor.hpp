@@ -0,0 +1,470 @@
+#ifndef WORK_STEALING_EXECUTOR_HPP
+#define WORK_STEALING_EXECUTOR_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * a pool of threads running posted handlers, as an alternative to several
+ * threads calling run() on one io_service (asio_steady_timer_example_three)
+ *
+ * every thread of an io_service takes its handlers from one queue behind one
+ * lock. Here every worker has its own deque: handlers posted from a worker go
+ * to that worker's deque, which only it pushes to and pops from (LIFO, no
+ * lock), and idle workers steal the oldest handlers from the others' deques
+ * (FIFO, one CAS). Handlers posted from other threads, e.g. completions of an
+ * io_service run elsewhere, go through a shared injection queue.
+ *
+ *   boost::asio::io_service io_service;        // one thread: the reactor
+ *   work_stealing_executor executor(8);        // the handlers
+ *   socket.async_read_some(buffer, executor.wrap(handler));
+ *
+ * nothing is ordered: handlers run concurrently, in any order, on any worker.
+ * Handlers must not throw.
+ */
+
+/**
+ * Chase-Lev work-stealing deque of T* ("Dynamic Circular Work-Stealing
+ * Deque", with the memory orderings of Le et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models")
+ *
+ * the owner calls push() and pop(), any thread steal(). The array grows when
+ * full; arrays outgrown are kept until the deque is destroyed, because a
+ * thief may still be reading them.
+ */
+template <class T>
+class work_stealing_deque
+{
+	public:
+		explicit work_stealing_deque(size_t capacity = 256) :
+			top(0),
+			bottom(0)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size *= 2;
+			arrays.push_back(std::unique_ptr<ring>(new ring(size)));
+			array.store(arrays.back().get(), std::memory_order_relaxed);
+		}
+
+		void push(T *item)
+		{
+			std::int64_t b = bottom.load(std::memory_order_relaxed);
+			std::int64_t t = top.load(std::memory_order_acquire);
+			ring *a = array.load(std::memory_order_relaxed);
+
+			if (b - t > static_cast<std::int64_t>(a->size) - 1)
+				a = grow(a, t, b);
+
+			a->put(b, item);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		/**
+		 * newest item, or nullptr
+		 */
+		T* pop()
+		{
+			std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+			ring *a = array.load(std::memory_order_relaxed);
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t t = top.load(std::memory_order_relaxed);
+
+			if (t > b)
+			{
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			T *item = a->get(b);
+			if (t == b)
+			{
+				// the last item: race the thieves for it
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					item = nullptr;
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return item;
+		}
+
+		/**
+		 * oldest item, or nullptr when empty or another thread won it
+		 */
+		T* steal()
+		{
+			std::int64_t t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t b = bottom.load(std::memory_order_acquire);
+
+			if (t >= b)
+				return nullptr;
+
+			T *item = array.load(std::memory_order_acquire)->get(t);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+			return item;
+		}
+
+		bool empty() const
+		{
+			return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+		}
+
+	private:
+		work_stealing_deque(const work_stealing_deque&);
+		work_stealing_deque& operator=(const work_stealing_deque&);
+
+		struct ring
+		{
+			explicit ring(size_t size) :
+				size(size),
+				mask(size - 1),
+				items(new std::atomic<T*>[size])
+			{}
+
+			T* get(std::int64_t i) const
+			{
+				return items[i & mask].load(std::memory_order_relaxed);
+			}
+
+			void put(std::int64_t i, T *item)
+			{
+				items[i & mask].store(item, std::memory_order_relaxed);
+			}
+
+			size_t								size;
+			size_t								mask;
+			std::unique_ptr<std::atomic<T*>[]>	items;
+		};
+
+		ring* grow(ring *a, std::int64_t t, std::int64_t b)
+		{
+			ring *bigger = new ring(a->size * 2);
+			for (std::int64_t i = t; i < b; i++)
+				bigger->put(i, a->get(i));
+
+			arrays.push_back(std::unique_ptr<ring>(bigger));
+			array.store(bigger, std::memory_order_release);
+			return bigger;
+		}
+
+		std::atomic<std::int64_t>				top;		// thieves
+		char									padding[64];	// keeps top and bottom on separate cache lines
+		std::atomic<std::int64_t>				bottom;		// owner
+		std::atomic<ring*>						array;
+		std::vector<std::unique_ptr<ring> >		arrays;		// owner only
+};
+
+class work_stealing_executor
+{
+	public:
+		/**
+		 * starts "threads" workers
+		 */
+		explicit work_stealing_executor(size_t threads = std::thread::hardware_concurrency()) :
+			sleeping(0),
+			injected_size(0),
+			wakeups(0),
+			stopping(false)
+		{
+			threads = std::max<size_t>(1, threads);
+			for (size_t i = 0; i < threads; i++)
+				workers.push_back(std::unique_ptr<worker>(new worker()));
+			for (size_t i = 0; i < threads; i++)
+				workers[i]->thread = std::thread([this, i]() { run(i); });
+		}
+
+		/**
+		 * runs what is still queued, then joins the workers
+		 */
+		~work_stealing_executor()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+				wakeups++;
+			}
+			wake.notify_all();
+
+			for (size_t i = 0; i < workers.size(); i++)
+				workers[i]->thread.join();
+		}
+
+		/**
+		 * runs handler() on one of the workers, never from inside post()
+		 */
+		template <class Handler>
+		void post(Handler handler)
+		{
+			task *t = new handler_task<Handler>(std::move(handler));
+
+			thread_identity &self = current();
+			if (self.executor == this)
+			{
+				workers[self.index]->deque.push(t);
+
+				// pairs with the fence in park(): either we see the sleeper or
+				// it sees the push
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (sleeping.load(std::memory_order_relaxed) > 0)
+					notify();
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			injected.push_back(t);
+			injected_size.store(injected.size(), std::memory_order_relaxed);
+			if (sleeping.load(std::memory_order_relaxed) > 0)
+			{
+				wakeups++;
+				wake.notify_one();
+			}
+		}
+
+		/**
+		 * a completion handler for asio operations that posts "handler", with
+		 * the operation's arguments, to the executor: whichever thread runs the
+		 * io_service then only hands completions over
+		 */
+		template <class Handler>
+		class wrapped_handler
+		{
+			public:
+				wrapped_handler(work_stealing_executor &executor, Handler handler) :
+					executor(&executor),
+					handler(std::move(handler))
+				{}
+
+				template <class... Args>
+				void operator()(const Args&... args) const
+				{
+					Handler h = handler;
+					executor->post([h, args...]() mutable { h(args...); });
+				}
+
+			private:
+				work_stealing_executor	*executor;
+				Handler					handler;
+		};
+
+		template <class Handler>
+		wrapped_handler<Handler> wrap(Handler handler)
+		{
+			return wrapped_handler<Handler>(*this, std::move(handler));
+		}
+
+		size_t size() const
+		{
+			return workers.size();
+		}
+
+		/**
+		 * handlers taken from another worker's deque, since construction
+		 */
+		unsigned long steals() const
+		{
+			unsigned long total = 0;
+			for (size_t i = 0; i < workers.size(); i++)
+				total += workers[i]->steals.load(std::memory_order_relaxed);
+			return total;
+		}
+
+	private:
+		work_stealing_executor(const work_stealing_executor&);
+		work_stealing_executor& operator=(const work_stealing_executor&);
+
+		struct task
+		{
+			virtual ~task() {}
+			virtual void run() = 0;
+		};
+
+		template <class Handler>
+		struct handler_task : task
+		{
+			explicit handler_task(Handler handler) : handler(std::move(handler)) {}
+
+			void run()
+			{
+				handler();
+			}
+
+			Handler handler;
+		};
+
+		struct worker
+		{
+			worker() : steals(0) {}
+
+			work_stealing_deque<task>		deque;
+			std::thread						thread;
+			std::atomic<unsigned long>		steals;
+		};
+
+		/**
+		 * the executor and worker the calling thread belongs to, if any
+		 */
+		struct thread_identity
+		{
+			work_stealing_executor	*executor;
+			size_t					index;
+		};
+
+		static thread_identity& current()
+		{
+			static thread_local thread_identity identity = { nullptr, 0 };
+			return identity;
+		}
+
+		/**
+		 * spins this many rounds of stealing before going to sleep
+		 */
+		static const int SPIN_ROUNDS = 64;
+
+		void run(size_t index)
+		{
+			current().executor = this;
+			current().index = index;
+
+			std::uint64_t random = index * 0x9e3779b97f4a7c15ull + 1;
+			int idle = 0;
+
+			for (;;)
+			{
+				task *t = find(index, random);
+				if (t)
+				{
+					t->run();
+					delete t;
+					idle = 0;
+					continue;
+				}
+
+				if (++idle < SPIN_ROUNDS)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+
+				if (!park())
+					break;
+				idle = 0;
+			}
+
+			current().executor = nullptr;
+		}
+
+		/**
+		 * own deque first, then the injection queue, then the other workers
+		 * starting at a random one
+		 */
+		task* find(size_t index, std::uint64_t &random)
+		{
+			worker &self = *workers[index];
+
+			task *t = self.deque.pop();
+			if (t)
+				return t;
+
+			t = take_injected();
+			if (t)
+				return t;
+
+			// xorshift, to spread the thieves over the victims
+			random ^= random << 13;
+			random ^= random >> 7;
+			random ^= random << 17;
+
+			size_t n = workers.size();
+			size_t start = static_cast<size_t>(random % n);
+			for (size_t i = 0; i < n; i++)
+			{
+				size_t victim = (start + i) % n;
+				if (victim == index)
+					continue;
+
+				t = workers[victim]->deque.steal();
+				if (t)
+				{
+					self.steals.fetch_add(1, std::memory_order_relaxed);
+					return t;
+				}
+			}
+			return nullptr;
+		}
+
+		task* take_injected()
+		{
+			// spinning workers must not queue up on the lock; one that misses
+			// a handler here finds it in park()
+			if (injected_size.load(std::memory_order_relaxed) == 0)
+				return nullptr;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (injected.empty())
+				return nullptr;
+
+			task *t = injected.front();
+			injected.pop_front();
+			injected_size.store(injected.size(), std::memory_order_relaxed);
+			return t;
+		}
+
+		/**
+		 * sleeps until there may be work; false once the executor stops and
+		 * nothing is left to run
+		 */
+		bool park()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			sleeping.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			std::uint64_t seen = wakeups;
+			while (!stopping && injected.empty() && all_deques_empty() && wakeups == seen)
+				wake.wait(lock);
+
+			sleeping.fetch_sub(1, std::memory_order_relaxed);
+			return !(stopping && injected.empty() && all_deques_empty());
+		}
+
+		bool all_deques_empty() const
+		{
+			for (size_t i = 0; i < workers.size(); i++)
+				if (!workers[i]->deque.empty())
+					return false;
+			return true;
+		}
+
+		void notify()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				wakeups++;
+			}
+			wake.notify_one();
+		}
+
+		std::vector<std::unique_ptr<worker> >	workers;
+		std::atomic<int>						sleeping;
+		std::atomic<size_t>						injected_size;
+
+		std::mutex								mutex;			// guards the rest
+		std::condition_variable					wake;
+		std::deque<task*>						injected;
+		std::uint64_t							wakeups;
+		bool									stopping;
+};
+
+#endif